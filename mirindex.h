@@ -0,0 +1,273 @@
+/* mirindex.h: a record index kept alongside a MIRIAD dataset
+   Licensed under the GNU GPL version 2 or later.
+
+   One metadata-only pass over a dataset with uvscan gives us, for every
+   record, its time, baseline, polarization, the size of its polarization
+   group, its number of channels, where its flags start in the "flags"
+   item, and whether the source or pointing changed with it. We save that
+   as a small binary file in the dataset directory so that later runs of
+   mirtoms and mirmsflagextract can size things up front without another
+   pass. The file remembers the size and modification time of "visdata",
+   and it's rebuilt whenever they change.
+
+   uvio doesn't tell us where records sit in "visdata", so there are no
+   byte offsets into it here; the flag offsets are what we can seek with.
+
+   Include this after miriad-c/miriad.h and mirvars.h.
+*/
+
+#ifndef MIRINDEX_H
+#define MIRINDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#define MIRINDEX_NAME "mirtoms-index"
+#define MIRINDEX_MAGIC 0x5844494d /* "MIDX" */
+#define MIRINDEX_VERSION 1
+
+enum {
+    MIRINDEX_GROUP_START = 1 << 0, // first record of a polarization group
+    MIRINDEX_NEW_SOURCE  = 1 << 1, // "source" changed with this record
+    MIRINDEX_NEW_FIELD   = 1 << 2  // "ra", "dec", "dra" or "ddec" did
+};
+
+struct MirIndexRecord {
+    double time;       // JD, as in the preamble
+    int64_t flagbit;   // index of the first channel flag of the record
+    float baseline;    // MIRIAD encoding, as in the preamble
+    int32_t nchan;
+    int16_t pol, npol;
+    int32_t bits;      // MIRINDEX_* flags
+};
+
+struct MirIndexHeader {
+    uint32_t magic, version;
+    int64_t vissize, vismtime, vismtimensec;
+    int32_t nrecord, ngroup, maxnchan, maxnpol;
+};
+
+struct MirIndex {
+    MirIndexHeader hdr;
+    std::vector<MirIndexRecord> recs;
+
+    // Index of the first record of each polarization group.
+    std::vector<int32_t> groups;
+};
+
+
+static bool
+mirindex_stat (const std::string& vis, MirIndexHeader& hdr)
+{
+    struct stat st;
+
+    if (stat ((vis + "/visdata").c_str (), &st))
+	return false;
+
+    hdr.vissize = st.st_size;
+    hdr.vismtime = st.st_mtim.tv_sec;
+    hdr.vismtimensec = st.st_mtim.tv_nsec;
+    return true;
+}
+
+
+static void
+mirindex_find_groups (MirIndex& idx)
+{
+    idx.groups.clear ();
+
+    for (size_t i = 0; i < idx.recs.size (); i++)
+	if (idx.recs[i].bits & MIRINDEX_GROUP_START)
+	    idx.groups.push_back ((int32_t) i);
+}
+
+
+static bool
+mirindex_load (const std::string& vis, MirIndex& idx)
+{
+    MirIndexHeader now;
+    FILE *f;
+    bool ok;
+
+    if (!mirindex_stat (vis, now))
+	return false;
+
+    if ((f = fopen ((vis + "/" MIRINDEX_NAME).c_str (), "rb")) == NULL)
+	return false;
+
+    ok = (fread (&idx.hdr, sizeof (idx.hdr), 1, f) == 1 &&
+	  idx.hdr.magic == MIRINDEX_MAGIC &&
+	  idx.hdr.version == MIRINDEX_VERSION &&
+	  idx.hdr.vissize == now.vissize &&
+	  idx.hdr.vismtime == now.vismtime &&
+	  idx.hdr.vismtimensec == now.vismtimensec &&
+	  idx.hdr.nrecord >= 0);
+
+    if (ok) {
+	idx.recs.resize (idx.hdr.nrecord);
+	ok = (idx.hdr.nrecord == 0 ||
+	      fread (&idx.recs[0], sizeof (MirIndexRecord), idx.hdr.nrecord, f) ==
+	      (size_t) idx.hdr.nrecord);
+    }
+
+    fclose (f);
+
+    if (ok)
+	mirindex_find_groups (idx);
+    return ok;
+}
+
+
+// Write to a temporary file and rename it into place, so that a reader
+// never sees half an index. The temporary file is named for our process,
+// since other processes -- the workers of mirtoms, or mirmsflagextract --
+// may be saving an index of the same dataset at the same time. Failing
+// is fine -- the dataset may well be read-only -- it just means the next
+// run has to scan again.
+
+static bool
+mirindex_save (const std::string& vis, const MirIndex& idx)
+{
+    std::string path = vis + "/" MIRINDEX_NAME;
+    char suffix[32];
+    FILE *f;
+    bool ok;
+
+    snprintf (suffix, sizeof (suffix), ".tmp.%ld", (long) getpid ());
+    std::string tmp = path + suffix;
+
+    if ((f = fopen (tmp.c_str (), "wb")) == NULL)
+	return false;
+
+    ok = (fwrite (&idx.hdr, sizeof (idx.hdr), 1, f) == 1 &&
+	  (idx.recs.empty () ||
+	   fwrite (&idx.recs[0], sizeof (MirIndexRecord), idx.recs.size (), f) ==
+	   idx.recs.size ()));
+
+    if (fclose (f) != 0)
+	ok = false;
+
+    if (ok && rename (tmp.c_str (), path.c_str ()) == 0)
+	return true;
+
+    remove (tmp.c_str ());
+    return false;
+}
+
+
+static void
+mirindex_build (const std::string& vis, MirIndex& idx)
+{
+    static const char *fieldvars[] = { "ra", "dec", "dra", "ddec", 0 };
+    int handle, iostat, npolleft = 0;
+    int64_t flagbit = 0;
+    MirVar<double> time;
+    MirVar<float> baseline;
+    MirVar<int> nchan, pol, npol;
+    MirVarHandle source, fieldvar;
+
+    memset (&idx.hdr, 0, sizeof (idx.hdr));
+    idx.hdr.magic = MIRINDEX_MAGIC;
+    idx.hdr.version = MIRINDEX_VERSION;
+    mirindex_stat (vis, idx.hdr);
+    idx.recs.clear ();
+
+    uvopen_c (&handle, vis.c_str (), "old");
+    time.attach (handle, "time");
+    baseline.attach (handle, "baseline");
+    nchan.attach (handle, "nchan");
+    pol.attach (handle, "pol");
+    npol.attach (handle, "npol");
+    source.attach (handle, "source");
+    for (int i = 0; fieldvars[i]; i++)
+	fieldvar.attach (handle, fieldvars[i]);
+
+    while (1) {
+	MirIndexRecord r;
+
+	uvscan_c (handle, "", &iostat);
+	if (iostat)
+	    break;
+
+	time.refresh ();
+	baseline.refresh ();
+	nchan.refresh ();
+	pol.refresh ();
+	npol.refresh ();
+
+	memset (&r, 0, sizeof (r));
+	r.time = time.value ();
+	r.baseline = baseline.value ();
+	r.nchan = nchan.value ();
+	r.pol = pol.value ();
+	r.npol = npol.value ();
+	r.flagbit = flagbit;
+	flagbit += r.nchan;
+
+	if (npolleft == 0) {
+	    r.bits |= MIRINDEX_GROUP_START;
+	    npolleft = (r.npol > 0) ? r.npol : 1;
+	    idx.hdr.ngroup++;
+	}
+
+	npolleft--;
+
+	if (source.updated ())
+	    r.bits |= MIRINDEX_NEW_SOURCE;
+	if (fieldvar.updated ())
+	    r.bits |= MIRINDEX_NEW_FIELD;
+
+	if (r.nchan > idx.hdr.maxnchan)
+	    idx.hdr.maxnchan = r.nchan;
+	if (r.npol > idx.hdr.maxnpol)
+	    idx.hdr.maxnpol = r.npol;
+
+	idx.recs.push_back (r);
+    }
+
+    uvclose_c (handle);
+    idx.hdr.nrecord = (int32_t) idx.recs.size ();
+    mirindex_find_groups (idx);
+}
+
+
+/* Check that the "flags" item is laid out the way the flag offsets in the
+   index assume: a 4-byte item header, which maskio counts as one int's
+   worth of bits, then the flags of every record back to back, 31 to an
+   int. If it isn't, or the item is missing, callers should fall back to
+   uvflgwr. */
+
+static bool
+mirindex_flags_match (const std::string& vis, const MirIndex& idx)
+{
+    struct stat st;
+    int64_t nbits = 0;
+
+    if (stat ((vis + "/flags").c_str (), &st))
+	return false;
+
+    if (!idx.recs.empty ())
+	nbits = idx.recs.back ().flagbit + idx.recs.back ().nchan;
+
+    return st.st_size == 4 * ((nbits + 31 + 30) / 31);
+}
+
+
+// Load the dataset's index, or scan the dataset and save a new one.
+
+static void
+mirindex_get (const std::string& vis, MirIndex& idx)
+{
+    if (mirindex_load (vis, idx))
+	return;
+
+    mirindex_build (vis, idx);
+    mirindex_save (vis, idx);
+}
+
+#endif
@@ -0,0 +1,247 @@
+/* mirkernels.h: vectorized inner loops shared by mirtoms and mirmsflagextract
+   Licensed under the GNU GPL version 2 or later.
+
+   Each kernel comes in a plain scalar version, which defines the expected
+   results, and SSE2 and AVX2 versions that must agree with it bit for bit.
+   The best version the CPU supports is picked once at startup; define
+   MIRKERNELS_SCALAR to always use the scalar code.
+*/
+
+#ifndef MIRKERNELS_H
+#define MIRKERNELS_H
+
+#include <string.h>
+
+#if (defined (__x86_64__) || defined (__i386__)) && !defined (MIRKERNELS_SCALAR)
+# define MIRKERNELS_X86 1
+# include <immintrin.h>
+#endif
+
+
+/* decode_spectrum: convert one MIRIAD spectrum into the CASA conventions.
+   MIRIAD baselines run ant1->ant2 and CASA's run ant2->ant1, so along with
+   negating UVW we need to conjugate the visibilities, which arrive as
+   interleaved (re, im) floats. MIRIAD flags are nonzero for good data, while
+   CASA's are True for bad data. The results are stored every `stride`
+   elements, i.e. down one correlation of a column-major (corr, chan) cell. */
+
+typedef void (*decode_spectrum_fn) (const float *data, const int *flags, int n,
+				    float *vis, bool *flag, int stride);
+
+static void
+decode_spectrum_scalar (const float *data, const int *flags, int n,
+			float *vis, bool *flag, int stride)
+{
+    for (int i = 0; i < n; i++) {
+	vis[2*i*stride] = +data[2*i];
+	vis[2*i*stride+1] = -data[2*i+1];
+	flag[i*stride] = (flags[i] == 0);
+    }
+}
+
+#ifdef MIRKERNELS_X86
+
+__attribute__ ((target ("sse2")))
+static void
+decode_spectrum_sse2 (const float *data, const int *flags, int n,
+		      float *vis, bool *flag, int stride)
+{
+    // Flipping the sign bit is exactly what scalar negation does.
+    const __m128 conj = _mm_castsi128_ps (_mm_set_epi32 (0x80000000, 0, 0x80000000, 0));
+    const __m128i zero = _mm_setzero_si128 ();
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m128 a = _mm_xor_ps (_mm_loadu_ps (data + 2*i), conj);
+	__m128 b = _mm_xor_ps (_mm_loadu_ps (data + 2*i + 4), conj);
+
+	_mm_storel_pi ((__m64 *) (vis + 2*i*stride), a);
+	_mm_storeh_pi ((__m64 *) (vis + 2*(i+1)*stride), a);
+	_mm_storel_pi ((__m64 *) (vis + 2*(i+2)*stride), b);
+	_mm_storeh_pi ((__m64 *) (vis + 2*(i+3)*stride), b);
+
+	__m128i f = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i *) (flags + i)), zero);
+	int m = _mm_movemask_ps (_mm_castsi128_ps (f));
+
+	flag[i*stride] = m & 1;
+	flag[(i+1)*stride] = (m >> 1) & 1;
+	flag[(i+2)*stride] = (m >> 2) & 1;
+	flag[(i+3)*stride] = (m >> 3) & 1;
+    }
+
+    decode_spectrum_scalar (data + 2*i, flags + i, n - i,
+			    vis + 2*i*stride, flag + i*stride, stride);
+}
+
+
+__attribute__ ((target ("avx2")))
+static void
+decode_spectrum_avx2 (const float *data, const int *flags, int n,
+		      float *vis, bool *flag, int stride)
+{
+    const __m256 conj = _mm256_castsi256_ps (_mm256_set_epi32 (0x80000000, 0, 0x80000000, 0,
+							       0x80000000, 0, 0x80000000, 0));
+    const __m256i zero = _mm256_setzero_si256 ();
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m256 a = _mm256_xor_ps (_mm256_loadu_ps (data + 2*i), conj);
+	__m256 b = _mm256_xor_ps (_mm256_loadu_ps (data + 2*i + 8), conj);
+	__m128 q[4] = { _mm256_castps256_ps128 (a), _mm256_extractf128_ps (a, 1),
+			_mm256_castps256_ps128 (b), _mm256_extractf128_ps (b, 1) };
+
+	for (int j = 0; j < 4; j++) {
+	    _mm_storel_pi ((__m64 *) (vis + 2*(i+2*j)*stride), q[j]);
+	    _mm_storeh_pi ((__m64 *) (vis + 2*(i+2*j+1)*stride), q[j]);
+	}
+
+	__m256i f = _mm256_cmpeq_epi32 (_mm256_loadu_si256 ((const __m256i *) (flags + i)), zero);
+	int m = _mm256_movemask_ps (_mm256_castsi256_ps (f));
+
+	for (int j = 0; j < 8; j++)
+	    flag[(i+j)*stride] = (m >> j) & 1;
+    }
+
+    decode_spectrum_sse2 (data + 2*i, flags + i, n - i,
+			  vis + 2*i*stride, flag + i*stride, stride);
+}
+
+#endif
+
+
+static decode_spectrum_fn
+select_decode_spectrum ()
+{
+#ifdef MIRKERNELS_X86
+    __builtin_cpu_init ();
+
+    if (__builtin_cpu_supports ("avx2"))
+	return decode_spectrum_avx2;
+    if (__builtin_cpu_supports ("sse2"))
+	return decode_spectrum_sse2;
+#endif
+    return decode_spectrum_scalar;
+}
+
+static const decode_spectrum_fn decode_spectrum = select_decode_spectrum ();
+
+
+/* encode_flags: the inverse direction, for mirmsflagextract. Take one CASA
+   FLAG cell, column-major (npol, nchan) and True for bad data, and split it
+   into npol MIRIAD flag arrays of nchan ints each, stored one after the
+   other in `flags` and nonzero for good data. The SIMD versions handle the
+   usual 1, 2 and 4 correlations by loading several channels' worth of
+   bools at once, widening each channel's bools into one 32-bit lane and
+   shifting out one correlation at a time. The output is deliberately one
+   int per channel rather than packed bits: that is what mkwrite_c takes
+   with MK_FLAGS, and maskio does the packing into its 31-bit words
+   itself, so packing here would only have to be undone again. */
+
+typedef void (*encode_flags_fn) (const bool *flag, int npol, int nchan, int *flags);
+
+// Channels from `first` on; the SIMD versions finish up with this.
+static void
+encode_flags_from (const bool *flag, int npol, int nchan, int *flags, int first)
+{
+    for (int p = 0; p < npol; p++)
+	for (int i = first; i < nchan; i++)
+	    flags[p*nchan+i] = !flag[i*npol+p];
+}
+
+static void
+encode_flags_scalar (const bool *flag, int npol, int nchan, int *flags)
+{
+    encode_flags_from (flag, npol, nchan, flags, 0);
+}
+
+#ifdef MIRKERNELS_X86
+
+
+__attribute__ ((target ("sse2")))
+static void
+encode_flags_sse2 (const bool *flag, int npol, int nchan, int *flags)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i one = _mm_set1_epi32 (1);
+    int i;
+
+    if (npol != 1 && npol != 2 && npol != 4) {
+	encode_flags_scalar (flag, npol, nchan, flags);
+	return;
+    }
+
+    for (i = 0; i + 4 <= nchan; i += 4) {
+	const bool *src = flag + i*npol;
+	__m128i v;
+
+	if (npol == 1) {
+	    int w;
+	    memcpy (&w, src, 4);
+	    v = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (_mm_cvtsi32_si128 (w), zero), zero);
+	} else if (npol == 2)
+	    v = _mm_unpacklo_epi16 (_mm_loadl_epi64 ((const __m128i *) src), zero);
+	else
+	    v = _mm_loadu_si128 ((const __m128i *) src);
+
+	for (int p = 0; p < npol; p++) {
+	    __m128i b = _mm_srl_epi32 (v, _mm_cvtsi32_si128 (8*p));
+	    _mm_storeu_si128 ((__m128i *) (flags + p*nchan + i), _mm_andnot_si128 (b, one));
+	}
+    }
+
+    encode_flags_from (flag, npol, nchan, flags, i);
+}
+
+
+__attribute__ ((target ("avx2")))
+static void
+encode_flags_avx2 (const bool *flag, int npol, int nchan, int *flags)
+{
+    const __m256i one = _mm256_set1_epi32 (1);
+    int i;
+
+    if (npol != 1 && npol != 2 && npol != 4) {
+	encode_flags_scalar (flag, npol, nchan, flags);
+	return;
+    }
+
+    for (i = 0; i + 8 <= nchan; i += 8) {
+	const bool *src = flag + i*npol;
+	__m256i v;
+
+	if (npol == 1)
+	    v = _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *) src));
+	else if (npol == 2)
+	    v = _mm256_cvtepu16_epi32 (_mm_loadu_si128 ((const __m128i *) src));
+	else
+	    v = _mm256_loadu_si256 ((const __m256i *) src);
+
+	for (int p = 0; p < npol; p++) {
+	    __m256i b = _mm256_srl_epi32 (v, _mm_cvtsi32_si128 (8*p));
+	    _mm256_storeu_si256 ((__m256i *) (flags + p*nchan + i), _mm256_andnot_si256 (b, one));
+	}
+    }
+
+    encode_flags_from (flag, npol, nchan, flags, i);
+}
+
+#endif
+
+
+static encode_flags_fn
+select_encode_flags ()
+{
+#ifdef MIRKERNELS_X86
+    __builtin_cpu_init ();
+
+    if (__builtin_cpu_supports ("avx2"))
+	return encode_flags_avx2;
+    if (__builtin_cpu_supports ("sse2"))
+	return encode_flags_sse2;
+#endif
+    return encode_flags_scalar;
+}
+
+static const encode_flags_fn encode_flags = select_encode_flags ();
+
+#endif
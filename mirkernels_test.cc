@@ -0,0 +1,194 @@
+/* mirkernels_test: check that every version of the mirkernels.h kernels
+   agrees with the scalar one bit for bit
+   Licensed under the GNU GPL version 2 or later.
+
+   Random inputs, including NaNs, infinities, and negative zeros, and
+   random flag masks go through each kernel version the CPU supports for
+   every length up to a few SIMD widths, so that every tail length is
+   covered, and the outputs are compared with memcmp. The output buffers
+   start out filled with the same garbage, so writing anything outside of
+   where a kernel should also counts as a mismatch. Exits nonzero if
+   anything disagrees.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "mirkernels.h"
+
+
+// The same xorshift generator as mirsynth.
+
+class Random {
+public:
+    Random (uint32_t seed) : state_p (seed ? seed : 1) {}
+
+    uint32_t next ()
+    {
+	state_p ^= state_p << 13;
+	state_p ^= state_p >> 17;
+	state_p ^= state_p << 5;
+	return state_p;
+    }
+
+private:
+    uint32_t state_p;
+};
+
+
+struct Variant {
+    const char *name;
+    decode_spectrum_fn decode;
+    encode_flags_fn encode;
+    bool supported;
+};
+
+
+static int nfailed = 0;
+
+static void
+fail (const char *kernel, const char *variant, const char *what1, int n1,
+      const char *what2, int n2)
+{
+    fprintf (stderr, "FAIL: %s_%s differs from the scalar version with %s=%d, %s=%d\n",
+	     kernel, variant, what1, n1, what2, n2);
+    nfailed++;
+}
+
+
+// Any bit pattern at all, which covers the special values.
+
+static float
+random_float (Random& rng)
+{
+    uint32_t bits = rng.next ();
+    float f;
+
+    memcpy (&f, &bits, sizeof (f));
+    return f;
+}
+
+
+static void
+test_decode_spectrum (const std::vector<Variant>& variants, Random& rng)
+{
+    const int maxn = 70, strides[] = { 1, 2, 3, 4 };
+
+    for (int n = 0; n <= maxn; n++) {
+	for (size_t s = 0; s < sizeof (strides) / sizeof (strides[0]); s++) {
+	    int stride = strides[s];
+	    std::vector<float> data (2 * maxn + 2);
+	    std::vector<int> flags (maxn + 1);
+	    std::vector<float> vis0 (2 * maxn * stride + 2);
+	    std::vector<char> flag0 (maxn * stride + 1);
+
+	    for (size_t i = 0; i < data.size (); i++)
+		data[i] = random_float (rng);
+	    for (size_t i = 0; i < flags.size (); i++)
+		flags[i] = (rng.next () & 1) ? 0 : (int) rng.next ();
+	    for (size_t i = 0; i < vis0.size (); i++)
+		vis0[i] = random_float (rng);
+	    for (size_t i = 0; i < flag0.size (); i++)
+		flag0[i] = rng.next () & 1;
+
+	    std::vector<float> want (vis0);
+	    std::vector<char> wantflag (flag0);
+
+	    decode_spectrum_scalar (&data[0], &flags[0], n, &want[0],
+				    (bool *) &wantflag[0], stride);
+
+	    for (size_t v = 0; v < variants.size (); v++) {
+		if (!variants[v].supported)
+		    continue;
+
+		std::vector<float> vis (vis0);
+		std::vector<char> flag (flag0);
+
+		variants[v].decode (&data[0], &flags[0], n, &vis[0], (bool *) &flag[0], stride);
+
+		if (memcmp (&vis[0], &want[0], vis.size () * sizeof (float)) ||
+		    memcmp (&flag[0], &wantflag[0], flag.size ()))
+		    fail ("decode_spectrum", variants[v].name, "n", n, "stride", stride);
+	    }
+	}
+    }
+}
+
+
+// Random masks of every correlation count up to 5, so that the scalar
+// fallback for 3 and 5 is exercised as well as the SIMD paths.
+
+static void
+test_encode_flags (const std::vector<Variant>& variants, Random& rng)
+{
+    const int maxchan = 70, maxpol = 5;
+
+    for (int npol = 1; npol <= maxpol; npol++) {
+	for (int nchan = 0; nchan <= maxchan; nchan++) {
+	    std::vector<char> flag (npol * nchan + 1);
+	    std::vector<int> flags0 (npol * nchan + 4);
+
+	    // Only 0 and 1, as a real bool array would hold.
+	    for (size_t i = 0; i < flag.size (); i++)
+		flag[i] = rng.next () & 1;
+	    for (size_t i = 0; i < flags0.size (); i++)
+		flags0[i] = (int) rng.next ();
+
+	    std::vector<int> want (flags0);
+	    encode_flags_scalar ((const bool *) &flag[0], npol, nchan, &want[0]);
+
+	    for (size_t v = 0; v < variants.size (); v++) {
+		if (!variants[v].supported)
+		    continue;
+
+		std::vector<int> flags (flags0);
+		variants[v].encode ((const bool *) &flag[0], npol, nchan, &flags[0]);
+
+		if (memcmp (&flags[0], &want[0], flags.size () * sizeof (int)))
+		    fail ("encode_flags", variants[v].name, "npol", npol, "nchan", nchan);
+	    }
+	}
+    }
+}
+
+
+int
+main (int argc, char **argv)
+{
+    std::vector<Variant> variants;
+    Random rng (20130501);
+
+#ifdef MIRKERNELS_X86
+    __builtin_cpu_init ();
+
+    Variant sse2 = { "sse2", decode_spectrum_sse2, encode_flags_sse2,
+		     (bool) __builtin_cpu_supports ("sse2") };
+    Variant avx2 = { "avx2", decode_spectrum_avx2, encode_flags_avx2,
+		     (bool) __builtin_cpu_supports ("avx2") };
+    variants.push_back (sse2);
+    variants.push_back (avx2);
+#endif
+
+    // The version dispatch picked has to agree too.
+    Variant picked = { "dispatched", decode_spectrum, encode_flags, true };
+    variants.push_back (picked);
+
+    for (size_t v = 0; v < variants.size (); v++)
+	printf ("%-10s %s\n", variants[v].name,
+		variants[v].supported ? "tested" : "not supported by this CPU; skipped");
+
+    for (int pass = 0; pass < 20; pass++) {
+	test_decode_spectrum (variants, rng);
+	test_encode_flags (variants, rng);
+    }
+
+    if (nfailed) {
+	fprintf (stderr, "%d mismatches\n", nfailed);
+	return 1;
+    }
+
+    printf ("all kernels agree with the scalar versions\n");
+    return 0;
+}
@@ -10,13 +10,13 @@
   A *very* incomplete list of deficiencies and TODOs:
   - we assume a single spectral window
   - we ignore "wide" channels
-  - option to 'or' in flags instead of straight copying
 */
 
 #include <casa/aips.h>
 #include <casa/stdio.h>
 #include <casa/iostream.h>
 #include <casa/OS/File.h>
+#include <casa/OS/Path.h>
 #include <casa/Utilities/GenSort.h>
 #include <casa/Arrays/Cube.h>
 #include <casa/Arrays/Matrix.h>
@@ -39,6 +39,13 @@
 #include <miriad-c/maxdimc.h>
 #include <miriad-c/miriad.h>
 
+#include "mirvars.h"
+#include "mirindex.h"
+#include "mirkernels.h"
+#include "mirstats.h"
+
+#include <algorithm>
+
 
 #define MYMAXCHAN 8192 // I feel so dirty.
 #define WARN(message) (cerr << "warning: " << message << endl);
@@ -88,21 +95,328 @@ enum _miriad_polarizations mspol_to_mir[] = {
 };
 
 const char *MIR_REC_COL = "MIRIAD_RECNUM";
+const char *MIR_OMIT_KW = "OMITTED_RECORDS"; // keyword of MIR_REC_COL
+const char *MIR_LASTREC_COL = "MIRIAD_LASTREC"; // only in averaged MSes
+const char *MIR_INPUT_COL = "MIRIAD_INPUT"; // only with several input datasets
+const char *SORT_KW = "MIRTOMS_SORT"; // row order, if not MIRIAD's
+
+
+/* Write records' flags, either straight into the "flags" item at the
+   offset the index gives, or through the uv layer at its current record.
+   The new flags are either copied over the old ones or or-ed into them, in
+   which case a channel stays good only if it's good in both. Records
+   whose flags come out the same as before are normally not written at
+   all, since after a typical flagging pass most of them haven't changed.
+   We keep count of what happened to each channel as we go. */
+
+class FlagWriter
+{
+public:
+    FlagWriter (int mirhandle, char *mask, Bool or_flags, Bool only_changed,
+		MirStats *stats);
+
+    // `oldflags` must hold the record's current flags on the uv path; with
+    // a mask we read them ourselves. `newflags` may be modified.
+    void write (const MirIndexRecord& rec, int *oldflags, int *newflags);
+    void report (ostream& os) const;
+
+private:
+    int mirhandle_p;
+    char *mask_p;
+    Bool or_p;
+    Bool only_changed_p;
+    MirPhase *readphase_p, *writephase_p;
+
+    uInt64 nrec_changed_p, nrec_same_p;
+    uInt64 nchan_flagged_p, nchan_unflagged_p, nchan_same_p;
+};
+
+
+FlagWriter::FlagWriter (int mirhandle, char *mask, Bool or_flags, Bool only_changed,
+			MirStats *stats) :
+    mirhandle_p (mirhandle),
+    mask_p (mask),
+    or_p (or_flags),
+    only_changed_p (only_changed),
+    readphase_p (mask ? mirstats_phase (stats, "mkread") : NULL),
+    writephase_p (mirstats_phase (stats, mask ? "mkwrite" : "uvflgwr")),
+    nrec_changed_p (0),
+    nrec_same_p (0),
+    nchan_flagged_p (0),
+    nchan_unflagged_p (0),
+    nchan_same_p (0)
+{
+}
+
+
+void
+FlagWriter::write (const MirIndexRecord& rec, int *oldflags, int *newflags)
+{
+    uInt64 nflagged = 0, nunflagged = 0;
+
+    if (mask_p) {
+	MirTimer t (readphase_p, false);
+	mkread_c (mask_p, MK_FLAGS, oldflags, rec.flagbit, rec.nchan, rec.nchan);
+    }
+
+    for (Int i = 0; i < rec.nchan; i++) {
+	Bool oldgood = (oldflags[i] != 0);
+
+	if (or_p && !oldgood)
+	    newflags[i] = 0;
+
+	if (oldgood && !newflags[i])
+	    nflagged++;
+	else if (!oldgood && newflags[i])
+	    nunflagged++;
+    }
+
+    nchan_flagged_p += nflagged;
+    nchan_unflagged_p += nunflagged;
+    nchan_same_p += rec.nchan - nflagged - nunflagged;
+
+    if (nflagged == 0 && nunflagged == 0) {
+	nrec_same_p++;
+	if (only_changed_p)
+	    return;
+    } else
+	nrec_changed_p++;
+
+    MirTimer t (writephase_p, false);
+
+    if (mask_p)
+	mkwrite_c (mask_p, MK_FLAGS, newflags, rec.flagbit, rec.nchan, rec.nchan);
+    else
+	uvflgwr_c (mirhandle_p, newflags);
+}
+
+
+void
+FlagWriter::report (ostream& os) const
+{
+    os << "records: " << nrec_changed_p << " changed, "
+       << nrec_same_p << " unchanged" << endl;
+    os << "channels: " << nchan_flagged_p << " newly flagged, "
+       << nchan_unflagged_p << " newly unflagged, "
+       << nchan_same_p << " unchanged" << endl;
+}
+
+
+/* Reading MIRIAD_RECNUM, DATA_DESC_ID and FLAG a cell at a time costs three
+   trips through the table system for every row. We only ever walk forward
+   through the MS, so we read them in blocks of rows instead. A block is a
+   whole number of FLAG tiles, so that the storage manager can hand over
+   whole tiles rather than assembling each cell. If the rows of a block
+   don't all have the same FLAG shape, which happens when polarization
+   setups change, we read that block's flags row by row.
+
+   An MS written with sort=time,baseline isn't in record order, and one
+   converted from several datasets has rows from all of them. For those we
+   read all of MIRIAD_RECNUM and DATA_DESC_ID up front, pick out the rows
+   of the `input` we want, if any, and sort them by record. Rows are then
+   numbered in that order rather than the MS's, and their flags have to
+   be read a cell at a time. */
+
+class RowBlocks
+{
+public:
+    RowBlocks (const MeasurementSet& ms, Int input, MirStats *stats);
+
+    // The number of rows we'll walk through, and how many DATA_DESC_IDs
+    // they use.
+    uInt nrow () const { return mapped_p ? order_p.size () : nrow_p; }
+    uInt ndesc () const { return ndesc_p; }
+
+    // Make sure that `row` is in the current block.
+    void load (uInt row);
+
+    Int recnum (uInt row) const { return recnums_p(at (row)); }
+    Int ddid (uInt row) const { return ddids_p(at (row)); }
+    const Bool *flags (uInt row, Int& npol, Int& nchan);
+
+private:
+    uInt at (uInt row) const { return mapped_p ? order_p[row] : row - start_p; }
+
+    ScalarColumn<Int> reccol_p;
+    ScalarColumn<Int> ddcol_p;
+    ArrayColumn<Bool> flagcol_p;
+
+    uInt nrow_p, blockrows_p, start_p, count_p, ndesc_p;
+    Vector<Int> recnums_p, ddids_p;
+    Array<Bool> flags_p;
+    Bool percell_p;
+    Matrix<Bool> cell_p;
+    Bool mapped_p;
+    std::vector<uInt> order_p; // if mapped, the MS rows we want in record order
+    MirPhase *phase_p;
+};
+
+
+RowBlocks::RowBlocks (const MeasurementSet& ms, Int input, MirStats *stats) :
+    reccol_p (ms, MIR_REC_COL),
+    ddcol_p (ms, MS::columnName (MS::DATA_DESC_ID)),
+    flagcol_p (ms, MS::columnName (MS::FLAG)),
+    nrow_p (ms.nrow ()),
+    start_p (0),
+    count_p (0),
+    ndesc_p (ms.dataDescription ().nrow ()),
+    percell_p (False),
+    mapped_p (False),
+    phase_p (mirstats_phase (stats, "msread"))
+{
+    // mirtoms records its FLAG tile shape; other MSes get a guess.
+    uInt tilerows = 1024;
+
+    if (ms.keywordSet ().isDefined ("MIRTOMS_TILING")) {
+	Vector<Int> tile = ms.keywordSet ().asRecord ("MIRTOMS_TILING").asArrayInt ("FLAG_TILE");
+	if (tile.nelements () == 3 && tile(2) > 0)
+	    tilerows = tile(2);
+    }
+
+    // Aim for about 16 MB of flags per block.
+    uInt cellsize = 1;
+    if (nrow_p > 0 && flagcol_p.isDefined (0))
+	cellsize = max ((uInt) flagcol_p.shape (0).product (), (uInt) 1);
+
+    blockrows_p = max ((uInt) ((16 << 20) / ((size_t) tilerows * cellsize)), (uInt) 1) * tilerows;
+
+    if (!ms.keywordSet ().isDefined (SORT_KW) && input < 0)
+	return;
+
+    MirTimer t (phase_p);
+    Vector<Int> inputs;
+    std::vector<bool> seen (ndesc_p);
+
+    reccol_p.getColumn (recnums_p, True);
+    ddcol_p.getColumn (ddids_p, True);
+    if (input >= 0)
+	ScalarColumn<Int> (ms, MIR_INPUT_COL).getColumn (inputs, True);
+
+    ndesc_p = 0;
+
+    for (uInt i = 0; i < nrow_p; i++) {
+	if (input >= 0 && inputs(i) != input)
+	    continue;
+
+	order_p.push_back (i);
+
+	if (ddids_p(i) >= 0 && ddids_p(i) < (Int) seen.size () && !seen[ddids_p(i)]) {
+	    seen[ddids_p(i)] = true;
+	    ndesc_p++;
+	}
+    }
+
+    mapped_p = True;
+    percell_p = True;
+    count_p = order_p.size ();
+
+    // The rows of a group share a record number and are already in
+    // DATA_DESC_ID order, which a stable sort keeps.
+
+    const Vector<Int>& recnums = recnums_p;
+    std::stable_sort (order_p.begin (), order_p.end (),
+		      [&recnums] (uInt a, uInt b) { return recnums(a) < recnums(b); });
+}
 
 
 void
-extract_flags (String& mspath, String& vispath)
+RowBlocks::load (uInt row)
+{
+    if (row >= start_p && row < start_p + count_p)
+	return;
+
+    MirTimer t (phase_p);
+    start_p = row;
+    count_p = min (blockrows_p, nrow_p - row);
+
+    Slicer rows (IPosition (1, start_p), IPosition (1, count_p));
+    reccol_p.getColumnRange (rows, recnums_p, True);
+    ddcol_p.getColumnRange (rows, ddids_p, True);
+
+    // A range get needs every cell in the block to have the same shape,
+    // which it won't if it spans spectral windows of different widths.
+    percell_p = False;
+
+    if (!flagcol_p.columnDesc ().isFixedShape ()) {
+	IPosition shape = flagcol_p.shape (start_p);
+
+	for (uInt r = start_p + 1; !percell_p && r < start_p + count_p; r++)
+	    percell_p = !flagcol_p.shape (r).isEqual (shape);
+    }
+
+    if (!percell_p)
+	flagcol_p.getColumnRange (rows, flags_p, True);
+}
+
+
+const Bool *
+RowBlocks::flags (uInt row, Int& npol, Int& nchan)
+{
+    if (percell_p) {
+	if (mapped_p)
+	    row = order_p[row];
+
+	flagcol_p.get (row, cell_p, True); // resizes on-the-fly
+	npol = cell_p.shape ()(0);
+	nchan = cell_p.shape ()(1);
+	return cell_p.data ();
+    }
+
+    npol = flags_p.shape ()(0);
+    nchan = flags_p.shape ()(1);
+    return flags_p.data () + (size_t) (row - start_p) * npol * nchan;
+}
+
+
+void
+extract_flags (String& mspath, String& vispath, Int input, Bool flag_omitted, Bool fast,
+	       Bool or_flags, Bool only_changed, MirStats *stats)
 {
     if (sizeof (double) != sizeof (Double))
 	WARN ("sizeof(Double) != sizeof(double); mirmsflagextract will probably fail");
     if (sizeof (int) != sizeof (Int))
 	WARN ("sizeof(Int) != sizeof(int); mirmsflagextract will probably fail");
 
-    // Open the MIRIAD dataset.
-
+    /* For the fast path we load the dataset's record index, scanning the
+       dataset first if it has none. The index says where each record's
+       flags live in the "flags" item and which polarization each record
+       has, which is all that we need. If the item looks the way it
+       should, we skip the uv layer entirely and write the flags through
+       maskio, which buffers them and never touches "visdata". Otherwise,
+       or with fast=false, we read through every record so that uvflgwr
+       knows where we are, and the index isn't needed. */
+
+    MirIndex index;
+    Bool indexed = fast;
     int mirhandle;
-    uvopen_c (&mirhandle, vispath.chars (), "old");
-    uvset_c (mirhandle, "preamble", "uvw/time/baseline", 0, 0.0, 0.0, 0.0);
+    char *mask = NULL;
+    MirVar<int> polvar, npolvar; // only on the slow path
+
+    if (fast) {
+	MirTimer t (mirstats_phase (stats, "index"));
+	mirindex_get (vispath.chars (), index);
+    }
+
+    if (fast && !mirindex_flags_match (vispath.chars (), index)) {
+	WARN ("layout of " + vispath + "/flags isn't as expected; using the slow path");
+	fast = False;
+    }
+
+    if (fast) {
+	int iostat;
+
+	hopen_c (&mirhandle, vispath.chars (), "old", &iostat);
+	if (iostat)
+	    throw AipsError ("cannot open MIRIAD dataset " + vispath);
+
+	if ((mask = mkopen_c (mirhandle, "flags", "old")) == NULL)
+	    throw AipsError ("cannot open " + vispath + "/flags");
+    } else {
+	uvopen_c (&mirhandle, vispath.chars (), "old");
+	uvset_c (mirhandle, "preamble", "uvw/time/baseline", 0, 0.0, 0.0, 0.0);
+	polvar.attach (mirhandle, "pol");
+	npolvar.attach (mirhandle, "npol");
+    }
 
     // Open the CASA dataset and load up the polarization/data-desc-id info.
     // We build a table that lets us quickly map from MIRIAD polarization
@@ -111,6 +425,40 @@ extract_flags (String& mspath, String& vispath)
     MeasurementSet ms (mspath, Table::Old);
     MSColumns msc (ms);
 
+    // Flags of averaged rows can't be mapped back onto the records that
+    // went into them without guessing.
+    if (ms.tableDesc ().isColumn (MIR_LASTREC_COL))
+	throw AipsError ("MS " + mspath + " was written with time or channel "
+			 "averaging, so its flags cannot be copied back");
+
+    /* An MS converted from several datasets says which rows came from
+       which, and where the datasets were. Unless told otherwise, we find
+       ours by its path. */
+
+    if (ms.tableDesc ().isColumn (MIR_INPUT_COL)) {
+	Vector<String> paths;
+	ScalarColumn<Int> (ms, MIR_INPUT_COL).keywordSet ().get ("INPUTS", paths);
+
+	if (input < 0) {
+	    String want = Path (vispath).absoluteName ();
+
+	    for (uInt i = 0; i < paths.nelements (); i++)
+		if (paths(i) == want)
+		    input = i;
+
+	    if (input < 0)
+		throw AipsError ("MS " + mspath + " was converted from several datasets, and " +
+				 vispath + " doesn't seem to be one of them; use input= "
+				 "to say which one it is");
+	} else if (input >= (Int) paths.nelements ())
+	    throw AipsError ("MS " + mspath + " was only converted from " +
+			     String::toString (paths.nelements ()) + " datasets");
+    } else if (input > 0)
+	throw AipsError ("MS " + mspath + " was converted from a single dataset");
+    else
+	input = -1;
+
+    RowBlocks blocks (ms, input, stats);
     Vector<Int> ddid_to_polid = msc.dataDescription ().polarizationId ().getColumn ();
 
     uInt num_polcfg = ms.polarization ().nrow ();
@@ -137,6 +485,53 @@ extract_flags (String& mspath, String& vispath)
 	}
     }
 
+    ScalarColumn<Int> mirreccol (ms, MIR_REC_COL);
+
+    /* An MS written with sparse=true has no rows for entirely flagged
+       records; instead it lists them as [begin, end) pairs of record
+       numbers. We step through that list alongside the records, and either
+       leave the omitted ones alone or flag them. */
+
+    Vector<Int> omitted;
+    if (mirreccol.keywordSet ().isDefined (MIR_OMIT_KW))
+	mirreccol.keywordSet ().get (MIR_OMIT_KW, omitted);
+
+    /* If we have the record index, it tells us how many groups the MS
+       ought to have rows for, so we can refuse a mismatched pair before
+       touching the dataset rather than stopping partway through with a
+       synchronization failure. A group has a row for each of its spectral
+       windows, and different setups may have different numbers of
+       windows, so with several DATA_DESC_IDs we can only bound the
+       count. Without the index, the walk finds any mismatch. */
+
+    uInt nrows = blocks.nrow ();
+
+    if (indexed) {
+	Int nkept = 0;
+	uInt k = 0;
+
+	for (size_t i = 0; i < index.groups.size (); i++) {
+	    Int r = index.groups[i];
+
+	    while (k < omitted.nelements () && r >= omitted(k + 1))
+		k += 2;
+	    if (!(k < omitted.nelements () && r >= omitted(k)))
+		nkept++;
+	}
+
+	uInt maxrows = (uInt) nkept * max (blocks.ndesc (), (uInt) 1);
+	if (nrows < (uInt) nkept || nrows > maxrows)
+	    throw AipsError ("MS " + mspath + " has " + String::toString (nrows) +
+			     " rows, but " + String::toString (nkept) +
+			     (maxrows > (uInt) nkept ? " to " + String::toString (maxrows) : String ("")) +
+			     " are expected from " + vispath +
+			     "; were they converted from the same dataset?");
+
+	if (index.hdr.maxnchan > MYMAXCHAN)
+	    throw AipsError ("cannot handle records with more than " +
+			     String::toString (MYMAXCHAN) + " channels");
+    }
+
     // OK, it looks like we can actually do this.
 
     hisopen_c (mirhandle, "append");
@@ -150,26 +545,46 @@ extract_flags (String& mspath, String& vispath)
        all driven by the MIRIAD dataset, though.
     */
 
-    ScalarColumn<Int> mirreccol (ms, MIR_REC_COL);
-    ScalarColumn<Int> ddcol (ms, MS::columnName (MS::DATA_DESC_ID));
-    ArrayColumn<bool> msflagcol (ms, MS::columnName (MS::FLAG));
+    FlagWriter writer (mirhandle, mask, or_flags, only_changed, stats);
+    MirPhase *readphase = mirstats_phase (stats, "uvread");
+
+    uInt nextomit = 0;
+    Bool omitting = False;
 
     Int recnum = 0, row = 0;
     int polsleft = 0;
     double preamble[5];
     float data[2 * MYMAXCHAN]; // complex, so 2 floats per channel
     int flags[MYMAXCHAN];
-    Matrix<Bool> msflags(0,0);
+    int newflags[MYMAXCHAN];
+    Int msnpol = 0, msnchan = 0;
+    std::vector<int> msplanes; // MIRIAD flags for each correlation of the group
+    std::vector<int> winplanes; // the same for each window, one after another
+    std::vector<Int> winchan;
     uInt cur_pol_cfg;
     Int nchan = -1;
+    MirIndexRecord rec; // the current record; only nchan on the slow path
 
     while (1) {
-	/* As far as I know, we need to actually read the UV data and friends,
-	   though we don't actually use them for anything... */
+	/* Without the fast path, we need to actually read the UV data and
+	   friends, though we don't actually use them for anything... */
 	Int nread;
-	uvread_c (mirhandle, preamble, data, flags, MYMAXCHAN, &nread);
-	if (nread <= 0)
-	    break;
+
+	if (fast) {
+	    if (recnum >= (Int) index.recs.size ())
+		break;
+	    rec = index.recs[recnum];
+	    nread = rec.nchan;
+	} else {
+	    MirTimer t (readphase, false);
+	    uvread_c (mirhandle, preamble, data, flags, MYMAXCHAN, &nread);
+	    if (nread <= 0)
+		break;
+
+	    polvar.refresh ();
+	    npolvar.refresh ();
+	    rec.nchan = nread;
+	}
 
 	if (nchan < 0)
 	    nchan = nread; // XXX sketchy.
@@ -182,27 +597,110 @@ extract_flags (String& mspath, String& vispath)
 	    /* We just started a new simultaneous polarization record. We need
 	     * to read in the next chunk of flags from the MS, taking care to
 	     * check sanity. */
-	    uvrdvr_c (mirhandle, H_INT, "npol", (char *) &polsleft, NULL, 1);
-
-	    Int msrecnum = mirreccol.get (row);
-	    if (msrecnum != recnum)
-		throw AipsError ("synchronization failure at MIRIAD record #" +
-				 String::toString (recnum) +
-				 " (0-based) and CASA row #" +
-				 String::toString (row) +
-				 " (0-based): should be at MIRIAD record #" +
-				 String::toString (msrecnum));
-
-	    msflagcol.get (row, msflags, True); // resizes on-the-fly
-	    cur_pol_cfg = ddid_to_polid[ddcol.get (row)];
+	    if (fast)
+		polsleft = rec.npol;
+	    else
+		polsleft = npolvar.value ();
+
+	    while (nextomit < omitted.nelements () && recnum >= omitted(nextomit + 1))
+		nextomit += 2;
+
+	    omitting = (nextomit < omitted.nelements () && recnum >= omitted(nextomit));
+
+	    if (omitting && recnum + polsleft > omitted(nextomit + 1))
+		throw AipsError ("omitted MIRIAD records " + String::toString (omitted(nextomit)) +
+				 " to " + String::toString (omitted(nextomit + 1)) +
+				 " (0-based) end partway through a polarization record");
+
+	    if (!omitting) {
+		if ((uInt) row >= nrows)
+		    throw AipsError ("synchronization failure at MIRIAD record #" +
+				     String::toString (recnum) +
+				     " (0-based): the MS has no more rows");
+
+		blocks.load (row);
+
+		Int msrecnum = blocks.recnum (row);
+		if (msrecnum != recnum)
+		    throw AipsError ("synchronization failure at MIRIAD record #" +
+				     String::toString (recnum) +
+				     " (0-based) and CASA row #" +
+				     String::toString (row) +
+				     " (0-based): should be at MIRIAD record #" +
+				     String::toString (msrecnum));
+
+		/* The group has a row for each spectral window, in
+		   DATA_DESC_ID order, which is the order that the
+		   windows' channels come in the MIRIAD record. We line up
+		   their flags the same way. */
+
+		cur_pol_cfg = ddid_to_polid[blocks.ddid (row)];
+		winplanes.clear ();
+		winchan.clear ();
+		msnchan = 0;
+
+		do {
+		    Int npol, wchan;
+		    const Bool *msflags = blocks.flags (row, npol, wchan);
+
+		    if (!winchan.empty () &&
+			((uInt) ddid_to_polid[blocks.ddid (row)] != cur_pol_cfg || npol != msnpol))
+			throw AipsError ("CASA rows #" + String::toString (row - winchan.size ()) +
+					 " to #" + String::toString (row) + " (0-based) of "
+					 "MIRIAD record #" + String::toString (recnum) +
+					 " have different polarizations");
+
+		    size_t at = winplanes.size ();
+		    winplanes.resize (at + (size_t) npol * wchan);
+		    encode_flags (msflags, npol, wchan, winplanes.data () + at);
+		    winchan.push_back (wchan);
+		    msnpol = npol;
+		    msnchan += wchan;
+
+		    if ((uInt) ++row < nrows)
+			blocks.load (row);
+		} while ((uInt) row < nrows && blocks.recnum (row) == recnum);
+
+		if (winchan.size () == 1)
+		    msplanes.swap (winplanes);
+		else {
+		    const int *src = winplanes.data ();
+		    Int off = 0;
+
+		    msplanes.resize ((size_t) msnpol * msnchan);
+		    for (size_t w = 0; w < winchan.size (); w++) {
+			for (Int p = 0; p < msnpol; p++, src += winchan[w])
+			    memcpy (&msplanes[(size_t) p * msnchan + off], src,
+				    winchan[w] * sizeof (int));
+			off += winchan[w];
+		    }
+		}
+	    }
+	} else if (!omitting && nextomit < omitted.nelements () && recnum >= omitted(nextomit))
+	    throw AipsError ("omitted MIRIAD records " + String::toString (omitted(nextomit)) +
+			     " to " + String::toString (omitted(nextomit + 1)) +
+			     " (0-based) start partway through a polarization record");
+
+	if (omitting) {
+	    // No MS row to consult; the whole record was flagged.
+	    if (flag_omitted) {
+		for (Int i = 0; i < nchan; i++)
+		    newflags[i] = 0;
+		writer.write (rec, flags, newflags);
+	    }
 
-	    row++; // next time, next row.
+	    recnum++;
+	    polsleft--;
+	    continue;
 	}
 
 	// Loop core is easy. Get pol, look up flag info, write to MIRIAD.
 
 	int mirpol;
-	uvrdvr_c (mirhandle, H_INT, "pol", (char *) &mirpol, NULL, 1);
+	if (fast)
+	    mirpol = rec.pol;
+	else
+	    mirpol = polvar.value ();
 
 	Int mspolidx = pol_indices(cur_pol_cfg,mirpol+MP_offset);
 	if (mspolidx < 0)
@@ -215,26 +713,41 @@ extract_flags (String& mspath, String& vispath)
 			     " has no data corresponding to MIRIAD polarization code " +
 			     String::toString (mirpol));
 
-	if (msflags.shape ()(1) != nchan)
+	if (msnchan != nchan)
 	    throw AipsError ("disagreeing numbers of channels; MIRIAD expects " +
 			     String::toString (nchan) + ", while CASA has " +
-			     String::toString (msflags.shape ()(1)));
+			     String::toString (msnchan));
 
-	for (Int i = 0; i < nchan; i++)
-	    // CASA and MIRIAD flag truthiness conventions differ.
-	    flags[i] = !msflags(mspolidx,i);
+	memcpy (newflags, &msplanes[(size_t) mspolidx * nchan], nchan * sizeof (int));
 
-	uvflgwr_c (mirhandle, flags);
+	writer.write (rec, flags, newflags);
 	recnum++;
 	polsleft--;
     }
 
+    if ((uInt) row != nrows)
+	throw AipsError ("MS " + mspath + " has " + String::toString (nrows - row) +
+			 " rows left over after the last record of " + vispath);
+
     // Wrap up.
 
+    if (stats) {
+	stats->count ("records", recnum);
+	stats->count ("channels", (double) recnum * max (nchan, 0));
+    }
+
+    MirTimer t (mirstats_phase (stats, "close"));
+
     hiswrite_c (mirhandle, ("MIRMSFLAGEXTRACT: processed " + String::toString (recnum) +
 			    " records").chars ());
     hisclose_c (mirhandle);
-    uvclose_c (mirhandle);
+    writer.report (cout);
+
+    if (fast) {
+	mkclose_c (mask);
+	hclose_c (mirhandle);
+    } else
+	uvclose_c (mirhandle);
 }
 
 
@@ -246,6 +759,12 @@ main (int argc, char **argv)
 	inp.version ("");
 	inp.create ("vis", "", "path of MIRIAD dataset to modify", "string");
 	inp.create ("ms", "", "path of MeasurementSet dataset with flags", "string");
+	inp.create ("fast", "True", "write the flags item directly when its layout allows?", "bool");
+	inp.create ("omitted", "keep", "records left out of a sparse MS: keep or flag", "string");
+	inp.create ("mode", "copy", "copy MS flags over MIRIAD's, or \"or\" them in", "string");
+	inp.create ("onlychanged", "True", "skip writing records whose flags don't change?", "bool");
+	inp.create ("input", "-1", "which input vis= was, for an MS made from several (-1 = by path)", "int");
+	inp.create ("stats", "", "path of a JSON timing report to write (default: none)", "string");
 	inp.readArguments (argc, argv);
 
 	String vis (inp.getString ("vis"));
@@ -260,7 +779,23 @@ main (int argc, char **argv)
 	if (! File (ms).isDirectory ())
 	    throw AipsError ("MS input path (ms=) does not refer to a directory");
 
-	extract_flags (ms, vis);
+	String omitted (inp.getString ("omitted"));
+	if (omitted != "keep" && omitted != "flag")
+	    throw AipsError ("omitted= must be \"keep\" or \"flag\"");
+
+	String mode (inp.getString ("mode"));
+	if (mode != "copy" && mode != "or")
+	    throw AipsError ("mode= must be \"copy\" or \"or\"");
+
+	String statspath (inp.getString ("stats"));
+	MirStats statsobj ("mirmsflagextract");
+	MirStats *stats = (statspath != "") ? &statsobj : NULL;
+
+	extract_flags (ms, vis, inp.getInt ("input"), omitted == "flag", inp.getBool ("fast"),
+		       mode == "or", inp.getBool ("onlychanged"), stats);
+
+	if (stats && !stats->write (statspath.chars ()))
+	    WARN ("could not write stats report to " + statspath);
     } catch (AipsError x) {
 	cerr << "error: " << x.getMesg () << endl;
 	return 1;
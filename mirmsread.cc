@@ -0,0 +1,164 @@
+/* mirmsread: time reading the main table of a MeasurementSet
+   Licensed under the GNU GPL version 2 or later.
+
+   This reads what an imaging or calibration pass goes through -- DATA,
+   FLAG, UVW, WEIGHT, and the per-row TIME, ANTENNA1, ANTENNA2,
+   DATA_DESC_ID, and FLAG_ROW -- in blocks of rows, every column for one
+   block before moving on to the next, and reports how many bytes of
+   values came back and how fast. It's meant for comparing the storage
+   layouts of mirtoms (see "make bench-layouts"), so it reads through the
+   casacore table system just as any other reader would. Blocks whose
+   cells differ in shape, such as those of spectral windows of different
+   widths, are read a cell at a time.
+*/
+
+#include <casa/aips.h>
+#include <casa/iostream.h>
+#include <casa/Arrays/Vector.h>
+#include <casa/Inputs/Input.h>
+#include <casa/namespace.h>
+
+#include <tables/Tables.h>
+#include <ms/MeasurementSets.h>
+
+#include <time.h>
+
+
+static double
+wall_clock ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+template<class T>
+static uInt64
+read_scalars (ScalarColumn<T>& col, const Slicer& rows, Vector<T>& buf)
+{
+    col.getColumnRange (rows, buf, True);
+    return (uInt64) buf.nelements () * sizeof (T);
+}
+
+
+template<class T>
+static uInt64
+read_arrays (ArrayColumn<T>& col, uInt start, uInt n, Array<T>& buf, Array<T>& cell)
+{
+    Bool same = col.columnDesc ().isFixedShape ();
+
+    if (!same) {
+	IPosition shape = col.shape (start);
+
+	same = True;
+	for (uInt r = start + 1; same && r < start + n; r++)
+	    same = col.shape (r).isEqual (shape);
+    }
+
+    if (same) {
+	col.getColumnRange (Slicer (IPosition (1, start), IPosition (1, n)), buf, True);
+	return (uInt64) buf.nelements () * sizeof (T);
+    }
+
+    uInt64 nbytes = 0;
+
+    for (uInt r = start; r < start + n; r++) {
+	col.get (r, cell, True);
+	nbytes += (uInt64) cell.nelements () * sizeof (T);
+    }
+
+    return nbytes;
+}
+
+
+static void
+read_ms (const String& mspath, Int blockrows)
+{
+    MeasurementSet ms (mspath, Table::Old);
+    uInt nrow = ms.nrow ();
+
+    ScalarColumn<Double> timecol (ms, MS::columnName (MS::TIME));
+    ScalarColumn<Int> ant1col (ms, MS::columnName (MS::ANTENNA1));
+    ScalarColumn<Int> ant2col (ms, MS::columnName (MS::ANTENNA2));
+    ScalarColumn<Int> ddcol (ms, MS::columnName (MS::DATA_DESC_ID));
+    ScalarColumn<Bool> flagrowcol (ms, MS::columnName (MS::FLAG_ROW));
+    ArrayColumn<Double> uvwcol (ms, MS::columnName (MS::UVW));
+    ArrayColumn<Float> weightcol (ms, MS::columnName (MS::WEIGHT));
+    ArrayColumn<Complex> datacol (ms, MS::columnName (MS::DATA));
+    ArrayColumn<Bool> flagcol (ms, MS::columnName (MS::FLAG));
+
+    // By default, about 16 MB of DATA per block, in whole tiles if we
+    // know how big mirtoms made them.
+    if (blockrows <= 0) {
+	Int tilerows = 1024;
+	uInt cellsize = 1;
+
+	if (ms.keywordSet ().isDefined ("MIRTOMS_TILING")) {
+	    Vector<Int> tile = ms.keywordSet ().asRecord ("MIRTOMS_TILING").asArrayInt ("DATA_TILE");
+	    if (tile.nelements () == 3 && tile(2) > 0)
+		tilerows = tile(2);
+	}
+
+	if (nrow > 0 && datacol.isDefined (0))
+	    cellsize = max ((uInt) datacol.shape (0).product () * (uInt) sizeof (Complex), (uInt) 1);
+
+	blockrows = max ((Int) ((16 << 20) / ((size_t) tilerows * cellsize)), 1) * tilerows;
+    }
+
+    Vector<Double> times;
+    Vector<Int> ant1s, ant2s, ddids;
+    Vector<Bool> flagrows;
+    Array<Double> uvws, uvwcell;
+    Array<Float> weights, weightcell;
+    Array<Complex> data, datacell;
+    Array<Bool> flags, flagcell;
+    uInt64 nbytes = 0;
+    double t0 = wall_clock ();
+
+    for (uInt start = 0; start < nrow; start += blockrows) {
+	uInt n = min ((uInt) blockrows, nrow - start);
+	Slicer rows (IPosition (1, start), IPosition (1, n));
+
+	nbytes += read_scalars (timecol, rows, times);
+	nbytes += read_scalars (ant1col, rows, ant1s);
+	nbytes += read_scalars (ant2col, rows, ant2s);
+	nbytes += read_scalars (ddcol, rows, ddids);
+	nbytes += read_scalars (flagrowcol, rows, flagrows);
+	nbytes += read_arrays (uvwcol, start, n, uvws, uvwcell);
+	nbytes += read_arrays (weightcol, start, n, weights, weightcell);
+	nbytes += read_arrays (datacol, start, n, data, datacell);
+	nbytes += read_arrays (flagcol, start, n, flags, flagcell);
+    }
+
+    double secs = wall_clock () - t0;
+
+    // One line, for the benefit of "make bench-layouts".
+    cout << mspath << ": " << nrow << " rows " << nbytes << " bytes "
+	 << secs << " s " << (secs > 0 ? nbytes / 1048576. / secs : 0.) << " MiB/s" << endl;
+}
+
+
+int
+main (int argc, char **argv)
+{
+    try {
+	Input inp (1);
+	inp.version ("");
+	inp.create ("ms", "", "path of MeasurementSet to read", "string");
+	inp.create ("rows", "0", "rows per block (0 = about 16 MB of DATA, in whole tiles)", "int");
+	inp.readArguments (argc, argv);
+
+	String ms (inp.getString ("ms"));
+	if (ms == "")
+	    throw AipsError ("no MS path (ms=) given");
+
+	read_ms (ms, inp.getInt ("rows"));
+    } catch (AipsError x) {
+	cerr << "error: " << x.getMesg () << endl;
+	return 1;
+    }
+
+    return 0;
+}
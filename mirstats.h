@@ -0,0 +1,252 @@
+/* mirstats.h: per-phase timing reports for mirtoms and mirmsflagextract
+   Licensed under the GNU GPL version 2 or later.
+
+   With stats= set, each tool times the phases of its work and writes a
+   JSON report when it's done. Timers are handed a MirPhase pointer that's
+   NULL when stats are off, in which case they do nothing at all -- no
+   clock reads, no lookups. A phase must only ever be timed from one
+   thread, and looked up outside of any per-record loop.
+
+   CPU time is per thread. For per-record phases, reading the thread CPU
+   clock would cost about as much as what's being measured, so those only
+   record wall time and their CPU time is reported as null.
+*/
+
+#ifndef MIRSTATS_H
+#define MIRSTATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct MirPhase {
+    double wall, cpu;
+    uint64_t calls;
+    bool hascpu;
+};
+
+
+static double
+mirstats_clock (clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime (id, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+class MirStats {
+public:
+    MirStats (const std::string& tool);
+
+    // Find or create a phase, or a column's share of the main table
+    // writes. These take a lock; call them outside of hot loops.
+    MirPhase *phase (const char *name);
+    MirPhase *column (const char *name);
+
+    // Counters are reported with their rates; only count from the main thread.
+    void count (const char *name, double n) { counters_p[name] += n; }
+
+    // Returns false if the report couldn't be written.
+    bool write (const std::string& path) const;
+
+private:
+    std::string tool_p;
+    double wall0_p;
+    std::mutex lock_p;
+    std::vector<std::string> order_p, colorder_p; // creation order, for the report
+    std::map<std::string, MirPhase> phases_p, columns_p;
+    std::map<std::string, double> counters_p;
+};
+
+
+// Convenience wrappers for when the stats object itself may be absent.
+
+static inline MirPhase *
+mirstats_phase (MirStats *stats, const char *name)
+{
+    return stats ? stats->phase (name) : NULL;
+}
+
+static inline MirPhase *
+mirstats_column (MirStats *stats, const char *name)
+{
+    return stats ? stats->column (name) : NULL;
+}
+
+
+// Times its own lifetime into a phase.
+
+class MirTimer {
+public:
+    MirTimer (MirPhase *phase, bool cpu = true) : phase_p (phase), cpu_p (cpu)
+    {
+	if (!phase_p)
+	    return;
+
+	wall0_p = mirstats_clock (CLOCK_MONOTONIC);
+	if (cpu_p)
+	    cpu0_p = mirstats_clock (CLOCK_THREAD_CPUTIME_ID);
+    }
+
+    ~MirTimer ()
+    {
+	if (!phase_p)
+	    return;
+
+	phase_p->wall += mirstats_clock (CLOCK_MONOTONIC) - wall0_p;
+	phase_p->calls++;
+
+	if (cpu_p) {
+	    phase_p->cpu += mirstats_clock (CLOCK_THREAD_CPUTIME_ID) - cpu0_p;
+	    phase_p->hascpu = true;
+	}
+    }
+
+private:
+    MirPhase *phase_p;
+    bool cpu_p;
+    double wall0_p, cpu0_p;
+};
+
+
+inline
+MirStats::MirStats (const std::string& tool) :
+    tool_p (tool),
+    wall0_p (mirstats_clock (CLOCK_MONOTONIC))
+{
+}
+
+
+inline MirPhase *
+MirStats::phase (const char *name)
+{
+    std::lock_guard<std::mutex> guard (lock_p);
+
+    if (!phases_p.count (name)) {
+	MirPhase p = { 0, 0, 0, false };
+	phases_p[name] = p;
+	order_p.push_back (name);
+    }
+
+    return &phases_p[name];
+}
+
+
+inline MirPhase *
+MirStats::column (const char *name)
+{
+    std::lock_guard<std::mutex> guard (lock_p);
+
+    if (!columns_p.count (name)) {
+	MirPhase p = { 0, 0, 0, false };
+	columns_p[name] = p;
+	colorder_p.push_back (name);
+    }
+
+    return &columns_p[name];
+}
+
+
+// rchar and wchar from /proc/self/io count every byte that went through
+// read () and write (), which is what we want: it includes casacore's
+// I/O as well as MIRIAD's. Returns false where that isn't available.
+
+static bool
+mirstats_io (double& nread, double& nwritten)
+{
+    FILE *f = fopen ("/proc/self/io", "r");
+    char line[128];
+    int found = 0;
+
+    if (f == NULL)
+	return false;
+
+    while (fgets (line, sizeof (line), f)) {
+	unsigned long long n;
+
+	if (sscanf (line, "rchar: %llu", &n) == 1) {
+	    nread = n;
+	    found++;
+	} else if (sscanf (line, "wchar: %llu", &n) == 1) {
+	    nwritten = n;
+	    found++;
+	}
+    }
+
+    fclose (f);
+    return found == 2;
+}
+
+
+static void
+mirstats_write_phases (FILE *f, const char *key, const std::vector<std::string>& order,
+		       const std::map<std::string, MirPhase>& phases)
+{
+    fprintf (f, "  \"%s\": {", key);
+
+    for (size_t i = 0; i < order.size (); i++) {
+	const MirPhase& p = phases.find (order[i])->second;
+
+	fprintf (f, "%s\n    \"%s\": {\"wall_seconds\": %.6f, ", i ? "," : "",
+		 order[i].c_str (), p.wall);
+	if (p.hascpu)
+	    fprintf (f, "\"cpu_seconds\": %.6f, ", p.cpu);
+	else
+	    fprintf (f, "\"cpu_seconds\": null, ");
+	fprintf (f, "\"calls\": %llu}", (unsigned long long) p.calls);
+    }
+
+    fprintf (f, "%s}", order.empty () ? "" : "\n  ");
+}
+
+
+inline bool
+MirStats::write (const std::string& path) const
+{
+    double wall = mirstats_clock (CLOCK_MONOTONIC) - wall0_p;
+    double nread = 0, nwritten = 0;
+    bool haveio = mirstats_io (nread, nwritten);
+    struct rusage ru;
+    FILE *f;
+
+    getrusage (RUSAGE_SELF, &ru);
+
+    if ((f = fopen (path.c_str (), "w")) == NULL)
+	return false;
+
+    fprintf (f, "{\n  \"tool\": \"%s\",\n", tool_p.c_str ());
+    fprintf (f, "  \"wall_seconds\": %.6f,\n", wall);
+    fprintf (f, "  \"cpu_seconds\": %.6f,\n",
+	     ru.ru_utime.tv_sec + 1e-6 * ru.ru_utime.tv_usec +
+	     ru.ru_stime.tv_sec + 1e-6 * ru.ru_stime.tv_usec);
+    fprintf (f, "  \"peak_rss_bytes\": %lld,\n", (long long) ru.ru_maxrss * 1024);
+
+    if (haveio)
+	fprintf (f, "  \"bytes_read\": %.0f,\n  \"bytes_written\": %.0f,\n", nread, nwritten);
+    else
+	fprintf (f, "  \"bytes_read\": null,\n  \"bytes_written\": null,\n");
+
+    // Each counter also gets a rate over the whole run.
+    for (std::map<std::string, double>::const_iterator i = counters_p.begin ();
+	 i != counters_p.end (); i++)
+	fprintf (f, "  \"%s\": %.0f,\n  \"%s_per_second\": %.3f,\n",
+		 i->first.c_str (), i->second, i->first.c_str (),
+		 wall > 0 ? i->second / wall : 0.);
+
+    mirstats_write_phases (f, "phases", order_p, phases_p);
+    fprintf (f, ",\n");
+    mirstats_write_phases (f, "column_writes", colorder_p, columns_p);
+    fprintf (f, "\n}\n");
+
+    return fclose (f) == 0;
+}
+
+#endif
@@ -0,0 +1,277 @@
+/* mirsynth: write synthetic MIRIAD datasets for testing and benchmarking
+   Licensed under the GNU GPL version 2 or later.
+
+   The datasets look like what mirtoms expects from the ATA: XX/XY/YX/YY
+   polarization groups (or a subset of them), one or more spectral
+   windows splitting up the channels evenly, Tsys for every antenna and
+   window, and a fixed array. The visibilities are a simple deterministic
+   pattern plus noise, and a chosen fraction of channels is flagged at
+   random. Every `scanlen` integrations we move on to the next pointing of
+   the current source, or to the next source after `npoint` pointings.
+   Everything is driven by `seed`, so the same arguments always produce
+   the same dataset.
+*/
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <casa/aips.h>
+#include <casa/iostream.h>
+#include <casa/OS/File.h>
+#include <casa/Inputs/Input.h>
+#include <casa/namespace.h>
+
+#include <miriad-c/maxdimc.h>
+#include <miriad-c/miriad.h>
+
+
+// MIRIAD codes for the polarizations of a group, in the order we write
+// them for each value of npol.
+static const int pols_by_npol[5][4] = {
+    { 0 },
+    { -5 },
+    { -5, -6 },
+    { 0 },
+    { -5, -7, -8, -6 }, // XX, XY, YX, YY
+};
+
+
+struct SynthOptions {
+    Int nants, nchan, nspect, npol, nints, nsource, npoint, scanlen;
+    Bool autos;
+    Double inttime, flagfrac;
+    uInt seed;
+};
+
+
+// A small xorshift generator: fast, and the same everywhere.
+
+class Random {
+public:
+    Random (uInt seed) : state_p (seed ? seed : 1) {}
+
+    uInt next ()
+    {
+	state_p ^= state_p << 13;
+	state_p ^= state_p >> 17;
+	state_p ^= state_p << 5;
+	return state_p;
+    }
+
+    // Uniform in [0, 1).
+    Double uniform () { return next () * (1. / 4294967296.); }
+
+private:
+    uInt state_p;
+};
+
+
+static void
+write_header (int tno, const SynthOptions& opts)
+{
+    double antpos[3*MAXANT];
+    double sfreq[MAXWIN], sdf[MAXWIN], restfreq[MAXWIN];
+    int nschan[MAXWIN], ischan[MAXWIN];
+    float systemp[MAXANT*MAXWIN];
+    double longitude = -2.1366, freq = 1.43;
+    float epoch = 2000;
+
+    // Antennas on a rough spiral a few hundred meters across; antpos is
+    // in nanoseconds, x then y then z.
+    for (Int i = 0; i < opts.nants; i++) {
+	double r = 20 + 15 * i, theta = 2.4 * i;
+
+	antpos[i] = r * cos (theta) / 0.299792458;
+	antpos[opts.nants + i] = r * sin (theta) / 0.299792458;
+	antpos[2 * opts.nants + i] = 0;
+    }
+
+    for (Int i = 0; i < opts.nspect; i++) {
+	nschan[i] = opts.nchan / opts.nspect;
+	ischan[i] = 1 + i * nschan[i];
+	sdf[i] = 0.0001; // GHz
+	sfreq[i] = freq + i * nschan[i] * sdf[i];
+	restfreq[i] = 1.420405752;
+    }
+
+    for (Int i = 0; i < opts.nants * opts.nspect; i++)
+	systemp[i] = 50 + (i % 7);
+
+    uvputvra_c (tno, "telescop", "ATA");
+    uvputvra_c (tno, "observer", "mirsynth");
+    uvputvra_c (tno, "project", "synthetic");
+    uvputvri_c (tno, "nants", &opts.nants, 1);
+    uvputvrd_c (tno, "antpos", antpos, 3 * opts.nants);
+    uvputvrd_c (tno, "longitu", &longitude, 1);
+    uvputvrr_c (tno, "epoch", &epoch, 1);
+    uvputvrd_c (tno, "freq", &freq, 1);
+    uvputvri_c (tno, "nspect", &opts.nspect, 1);
+    uvputvri_c (tno, "nschan", nschan, opts.nspect);
+    uvputvri_c (tno, "ischan", ischan, opts.nspect);
+    uvputvrd_c (tno, "sdf", sdf, opts.nspect);
+    uvputvrd_c (tno, "sfreq", sfreq, opts.nspect);
+    uvputvrd_c (tno, "restfreq", restfreq, opts.nspect);
+    uvputvrr_c (tno, "systemp", systemp, opts.nants * opts.nspect);
+
+    float inttime = opts.inttime;
+    uvputvrr_c (tno, "inttime", &inttime, 1);
+}
+
+
+// Change source, or pointing within the current source, as scan `scan`
+// requires.
+
+static void
+write_pointing (int tno, const SynthOptions& opts, Int scan)
+{
+    Int isource = (scan / opts.npoint) % opts.nsource;
+    Int ipoint = scan % opts.npoint;
+    char source[16];
+    double ra = 0.3 + 0.4 * isource, dec = 0.7 - 0.05 * isource;
+    float dra = 1e-4 * ipoint, ddec = -1e-4 * ipoint;
+
+    snprintf (source, sizeof (source), "src%d", isource);
+    uvputvra_c (tno, "source", source);
+    uvputvrd_c (tno, "ra", &ra, 1);
+    uvputvrd_c (tno, "dec", &dec, 1);
+    uvputvrr_c (tno, "dra", &dra, 1);
+    uvputvrr_c (tno, "ddec", &ddec, 1);
+}
+
+
+static void
+synthesize (const String& vispath, const SynthOptions& opts)
+{
+    static float data[2*MAXCHAN];
+    static int flags[MAXCHAN];
+    double preamble[5];
+    int tno;
+    Random rng (opts.seed);
+    Int npol = opts.npol;
+    int64_t nrec = 0;
+
+    uvopen_c (&tno, vispath.chars (), "new");
+    uvset_c (tno, "preamble", "uvw/time/baseline", 0, 0., 0., 0.);
+
+    hisopen_c (tno, "write");
+    hiswrite_c (tno, "MIRSYNTH: synthetic dataset");
+    hisclose_c (tno);
+
+    write_header (tno, opts);
+    uvputvri_c (tno, "npol", &npol, 1);
+
+    for (Int t = 0; t < opts.nints; t++) {
+	if (t % opts.scanlen == 0)
+	    write_pointing (tno, opts, t / opts.scanlen);
+
+	preamble[3] = 2456000.5 + t * opts.inttime / 86400.;
+
+	for (Int a1 = 1; a1 <= opts.nants; a1++) {
+	    for (Int a2 = a1; a2 <= opts.nants; a2++) {
+		if (a1 == a2 && !opts.autos)
+		    continue;
+
+		// A crude rotation of the baseline over the track, in ns.
+		double ha = 2 * M_PI * t * opts.inttime / 86400.;
+		double bx = (a2 - a1) * 50., by = (a2 + a1) * 7.;
+
+		preamble[0] = bx * cos (ha) - by * sin (ha);
+		preamble[1] = bx * sin (ha) + by * cos (ha);
+		preamble[2] = 0.1 * preamble[0];
+		preamble[4] = 256 * a1 + a2;
+
+		for (Int p = 0; p < npol; p++) {
+		    int pol = pols_by_npol[npol][p];
+		    float amp = (a1 == a2) ? 100. : 1. + 0.01 * (a1 + a2);
+
+		    uvputvri_c (tno, "pol", &pol, 1);
+
+		    for (Int i = 0; i < opts.nchan; i++) {
+			float phase = 0.001 * i * (a2 - a1) + 0.1 * p;
+
+			data[2*i] = amp * cos (phase) + (rng.uniform () - 0.5);
+			data[2*i+1] = (a1 == a2) ? 0. : amp * sin (phase) + (rng.uniform () - 0.5);
+			flags[i] = (rng.uniform () >= opts.flagfrac);
+		    }
+
+		    uvwrite_c (tno, preamble, data, flags, opts.nchan);
+		    nrec++;
+		}
+	    }
+	}
+    }
+
+    uvclose_c (tno);
+
+    cout << vispath << ": " << nrec << " records of " << opts.nchan << " channels" << endl;
+}
+
+
+int
+main (int argc, char **argv)
+{
+    try {
+	Input inp (1);
+	inp.version ("");
+	inp.create ("vis", "", "path of MIRIAD dataset to create", "string");
+	inp.create ("nants", "8", "number of antennas", "int");
+	inp.create ("nchan", "1024", "number of spectral channels, over all windows", "int");
+	inp.create ("nspect", "1", "number of spectral windows", "int");
+	inp.create ("npol", "4", "polarizations per group: 1 (XX), 2 (XX, YY), or 4", "int");
+	inp.create ("ints", "100", "number of integrations", "int");
+	inp.create ("inttime", "10", "integration time in seconds", "double");
+	inp.create ("autos", "True", "include autocorrelations?", "bool");
+	inp.create ("flagfrac", "0", "fraction of channels to flag at random", "double");
+	inp.create ("nsource", "1", "number of sources to cycle through", "int");
+	inp.create ("npoint", "1", "number of pointings per source", "int");
+	inp.create ("scanlen", "10", "integrations before moving to the next pointing", "int");
+	inp.create ("seed", "1", "random number seed", "int");
+	inp.readArguments (argc, argv);
+
+	String vis (inp.getString ("vis"));
+	if (vis == "")
+	    throw AipsError ("no output path (vis=) given");
+	if (File (vis).exists ())
+	    throw AipsError ("output path (vis=) already exists");
+
+	SynthOptions opts;
+	opts.nants = inp.getInt ("nants");
+	opts.nchan = inp.getInt ("nchan");
+	opts.nspect = inp.getInt ("nspect");
+	opts.npol = inp.getInt ("npol");
+	opts.nints = inp.getInt ("ints");
+	opts.inttime = inp.getDouble ("inttime");
+	opts.autos = inp.getBool ("autos");
+	opts.flagfrac = inp.getDouble ("flagfrac");
+	opts.nsource = inp.getInt ("nsource");
+	opts.npoint = inp.getInt ("npoint");
+	opts.scanlen = inp.getInt ("scanlen");
+	opts.seed = inp.getInt ("seed");
+
+	if (opts.nants < 1 || opts.nants > MAXANT)
+	    throw AipsError ("nants= must be between 1 and " + String::toString (MAXANT));
+	if (opts.nchan < 1 || opts.nchan > MAXCHAN)
+	    throw AipsError ("nchan= must be between 1 and " + String::toString (MAXCHAN));
+	if (opts.nspect < 1 || opts.nspect > MAXWIN || opts.nchan % opts.nspect != 0)
+	    throw AipsError ("nspect= must be between 1 and " + String::toString (MAXWIN) +
+			     " and divide nchan=");
+	if (opts.npol != 1 && opts.npol != 2 && opts.npol != 4)
+	    throw AipsError ("npol= must be 1, 2, or 4");
+	if (opts.nints < 1 || opts.inttime <= 0)
+	    throw AipsError ("ints= and inttime= must be positive");
+	if (opts.flagfrac < 0 || opts.flagfrac > 1)
+	    throw AipsError ("flagfrac= must be between 0 and 1");
+	if (opts.nsource < 1 || opts.npoint < 1 || opts.scanlen < 1)
+	    throw AipsError ("nsource=, npoint=, and scanlen= must be positive");
+	if (!opts.autos && opts.nants < 2)
+	    throw AipsError ("need at least two antennas without autocorrelations");
+
+	synthesize (vis, opts);
+    } catch (AipsError x) {
+	cerr << "error: " << x.getMesg () << endl;
+	return 1;
+    }
+
+    return 0;
+}
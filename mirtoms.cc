@@ -14,13 +14,21 @@ uvfitsfiller.
 
 The big problem with this program right now is that we really need to make two
 passes through the dataset to build up lists of all of the pol'n configs,
-pointings, etc., before we can actually start writing everything out.
+pointings, etc., before we can actually start writing everything out. The
+record index (mirindex.h) is a first pass of sorts: it lets us size the main
+table and split the work up front, but the subtables are still built as we
+go.
 */
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <casa/aips.h>
 #include <casa/stdio.h>
 #include <casa/iostream.h>
 #include <casa/OS/File.h>
+#include <casa/OS/Path.h>
 #include <casa/Utilities/GenSort.h>
 #include <casa/Arrays/Cube.h>
 #include <casa/Arrays/Matrix.h>
@@ -32,51 +40,1596 @@ pointings, etc., before we can actually start writing everything out.
 #include <casa/Inputs/Input.h>
 #include <casa/namespace.h>
 
-#include <measures/Measures.h>
-#include <measures/Measures/MPosition.h>
-#include <measures/Measures/MeasData.h>
-#include <measures/Measures/Stokes.h>
-#include <tables/Tables.h>
-#include <tables/Tables/TableInfo.h>
-#include <ms/MeasurementSets.h>
+#include <measures/Measures.h>
+#include <measures/Measures/MPosition.h>
+#include <measures/Measures/MeasData.h>
+#include <measures/Measures/Stokes.h>
+#include <tables/Tables.h>
+#include <tables/Tables/TableInfo.h>
+#include <tables/Tables/CompressComplex.h>
+#include <ms/MeasurementSets.h>
+
+#include <miriad-c/maxdimc.h>
+#include <miriad-c/miriad.h>
+
+#include "mirkernels.h"
+#include "mirvars.h"
+#include "mirindex.h"
+#include "mirstats.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+#define WARN(message) (cerr << "warning: " << message << endl);
+
+const char *MIR_REC_COL = "MIRIAD_RECNUM";
+const char *MIR_LASTREC_COL = "MIRIAD_LASTREC"; // only in averaged MSes
+const char *MIR_INPUT_COL = "MIRIAD_INPUT"; // only with several input datasets
+const char *CHECKPOINT_KW = "MIRTOMS_CHECKPOINT";
+const char *MIR_OMIT_KW = "OMITTED_RECORDS"; // keyword of MIR_REC_COL
+const char *SORT_KW = "MIRTOMS_SORT"; // row order, if not MIRIAD's
+const char *STATE_KW = "MIRTOMS_STATE"; // what append=true carries on from
+
+
+#ifdef MIRTOMS_COUNT_ALLOCS
+// Build with -DMIRTOMS_COUNT_ALLOCS to have fillMSMainTable report how many
+// heap allocations its record loop makes. In the steady state there should
+// be none, so the count shouldn't scale with the number of records.
+
+static unsigned long alloc_count = 0;
+
+void *
+operator new (size_t size)
+{
+    void *p = malloc (size ? size : 1);
+
+    if (p == NULL)
+	throw std::bad_alloc ();
+
+    alloc_count++;
+    return p;
+}
+
+void
+operator delete (void *p) noexcept
+{
+    free (p);
+}
+#endif
+
+
+typedef struct window {
+    // CASA defines everything mid-band, mid-interval
+    int    nspect;                   // number of valid windows (<=MAXWIN, typically 16)
+    int    nschan[MAXWIN+MAXWIDE];   // number of channels in a window
+    int    ischan[MAXWIN+MAXWIDE];   // starting channel of a window (1-based)
+    double sdf[MAXWIN+MAXWIDE];      // channel separation
+    double sfreq[MAXWIN+MAXWIDE];    // frequency of first channel in window (doppler changes)
+    double restfreq[MAXWIN+MAXWIDE]; // rest freq, if appropriate
+    char   code[MAXWIN+MAXWIDE];     // code to CASA identification (N, W or S; S not used anymore)
+
+    int    nwide;                    // number of wide band channels
+    float  wfreq[MAXWIDE];           // freq
+    float  wwidth[MAXWIDE];          // width
+} WINDOW;
+
+
+// Everything describing a group of simultaneous polarization records
+// except for the visibilities and flags themselves.
+
+struct GroupHeader {
+    Int recnum;       // MIRIAD record number of the group's first record
+    Int lastrec;      // ... and of its last, or the last one averaged in
+    Int ant1, ant2;   // 0-based, CASA convention
+    Int array, field, scan;
+    Int input;        // which input dataset it came from
+    Int spwbase;      // DATA_DESC_ID of its first IF
+    Double time, interval, exposure;
+    Double uvw[3];    // meters, CASA sign convention
+    Float weight[4];  // per correlation
+};
+
+
+// Collects the MS rows of several polarization groups so that they can be
+// committed with one addRow () and a range put per column, instead of a
+// dozen cell puts for every row. Each group becomes one row per IF, so the
+// rows of any given IF are evenly strided through the batch.
+
+class RowBatch {
+public:
+    RowBatch (MeasurementSet& ms, MSColumns& msc, Int ncorr, Int ncat,
+	      const WINDOW& win, Int ngroups, MirStats *stats);
+
+    Bool full () const { return ngroup_p == capacity_p; }
+    Int nextGroup () const { return ngroup_p; }
+    void clearGroup (Int g);
+    Bool groupFlagged (Int g) const;
+    void addGroup (const GroupHeader& hdr);
+    void flush (uInt& nextrow);
+
+    // Time spent putting DATA cells, which includes any compression, and
+    // the number of visibilities put.
+    Double dataSeconds () const { return datasecs_p; }
+    Double dataValues () const { return datavalues_p; }
+
+    // The (corr, chan) cell of one IF of a group, in column-major order.
+    // Callers decode straight into these rather than into a scratch
+    // buffer that would then have to be sliced up by IF.
+    Complex *visCell (Int ifno, Int g) { return data_p[ifno].data () + g * cellsize_p[ifno]; }
+    Bool *flagCell (Int ifno, Int g) { return flag_p[ifno].data () + g * cellsize_p[ifno]; }
+
+private:
+    template<class C, class V>
+    void put (const char *name, C& col, const Slicer& rows, const V& values)
+    {
+	MirTimer t (mirstats_column (stats_p, name));
+	col.putColumnRange (rows, values);
+    }
+
+    MeasurementSet& ms_p;
+    MSColumns& msc_p;
+    MirStats *stats_p;
+    ScalarColumn<Int> mirreccol_p, lastreccol_p, inputcol_p;
+    Bool haslastrec_p, hasinput_p;
+    Int nspect_p, capacity_p, ngroup_p, ncorr_p;
+    Double datasecs_p, datavalues_p;
+
+    Vector<Int> ant1_p, ant2_p, array_p, field_p, ddid_p, scan_p, recnum_p, lastrec_p, input_p;
+    Vector<Int> zeros_p, negones_p;
+    Vector<Double> time_p, interval_p, exposure_p;
+    Vector<Bool> flagrow_p;
+    Matrix<Double> uvw_p;
+    Matrix<Float> weight_p, ones_p;
+    Block<Int> cellsize_p;
+    Block<Cube<Complex> > data_p;  // (corr, chan, group)
+    Block<Cube<Bool> > flag_p;
+    Block<Array<Bool> > flagcat_p; // (corr, chan, cat, group)
+};
+
+
+RowBatch::RowBatch (MeasurementSet& ms, MSColumns& msc, Int ncorr, Int ncat,
+		    const WINDOW& win, Int ngroups, MirStats *stats)
+    : ms_p (ms), msc_p (msc), stats_p (stats), mirreccol_p (ms, MIR_REC_COL)
+{
+    nspect_p = win.nspect;
+    capacity_p = ngroups;
+    ngroup_p = 0;
+    ncorr_p = ncorr;
+    datasecs_p = datavalues_p = 0;
+
+    haslastrec_p = ms.tableDesc ().isColumn (MIR_LASTREC_COL);
+    if (haslastrec_p)
+	lastreccol_p.attach (ms, MIR_LASTREC_COL);
+
+    hasinput_p = ms.tableDesc ().isColumn (MIR_INPUT_COL);
+    if (hasinput_p)
+	inputcol_p.attach (ms, MIR_INPUT_COL);
+
+    Int nrow = nspect_p * capacity_p;
+
+    ant1_p.resize (nrow);
+    ant2_p.resize (nrow);
+    array_p.resize (nrow);
+    field_p.resize (nrow);
+    ddid_p.resize (nrow);
+    scan_p.resize (nrow);
+    recnum_p.resize (nrow);
+    lastrec_p.resize (nrow);
+    input_p.resize (nrow);
+    time_p.resize (nrow);
+    interval_p.resize (nrow);
+    exposure_p.resize (nrow);
+    flagrow_p.resize (nrow);
+    uvw_p.resize (3, nrow);
+    weight_p.resize (ncorr, nrow);
+
+    zeros_p.resize (nrow);
+    zeros_p = 0;
+    negones_p.resize (nrow);
+    negones_p = -1;
+    ones_p.resize (ncorr, nrow);
+    ones_p = 1.0;
+
+    cellsize_p.resize (nspect_p);
+    data_p.resize (nspect_p);
+    flag_p.resize (nspect_p);
+    flagcat_p.resize (nspect_p);
+
+    for (Int i = 0; i < nspect_p; i++) {
+	cellsize_p[i] = ncorr * win.nschan[i];
+	data_p[i].resize (ncorr, win.nschan[i], capacity_p);
+	flag_p[i].resize (ncorr, win.nschan[i], capacity_p);
+
+	if (ncat > 0) {
+	    flagcat_p[i].resize (IPosition (4, ncorr, win.nschan[i], ncat, capacity_p));
+	    flagcat_p[i] = False;
+	}
+    }
+}
+
+
+void
+RowBatch::clearGroup (Int g)
+{
+    // Flag everything, in case the group doesn't cover every correlation.
+    for (Int i = 0; i < nspect_p; i++) {
+	Complex *v = visCell (i, g);
+	Bool *f = flagCell (i, g);
+
+	for (Int j = 0; j < cellsize_p[i]; j++) {
+	    v[j] = 0;
+	    f[j] = True;
+	}
+    }
+}
+
+
+Bool
+RowBatch::groupFlagged (Int g) const
+{
+    for (Int i = 0; i < nspect_p; i++) {
+	const Bool *f = flag_p[i].data () + g * cellsize_p[i];
+
+	for (Int j = 0; j < cellsize_p[i]; j++)
+	    if (!f[j])
+		return False;
+    }
+
+    return True;
+}
+
+
+void
+RowBatch::addGroup (const GroupHeader& hdr)
+{
+    Int g = ngroup_p++;
+    Bool flagrow = groupFlagged (g);
+
+    for (Int i = 0; i < nspect_p; i++) {
+	Int r = g * nspect_p + i;
+
+	ant1_p(r) = hdr.ant1;
+	ant2_p(r) = hdr.ant2;
+	array_p(r) = hdr.array;
+	field_p(r) = hdr.field;
+	ddid_p(r) = hdr.spwbase + i;
+	scan_p(r) = hdr.scan;
+	recnum_p(r) = hdr.recnum;
+	lastrec_p(r) = hdr.lastrec;
+	input_p(r) = hdr.input;
+	time_p(r) = hdr.time;
+	interval_p(r) = hdr.interval;
+	exposure_p(r) = hdr.exposure;
+	flagrow_p(r) = flagrow;
+	uvw_p(0,r) = hdr.uvw[0];
+	uvw_p(1,r) = hdr.uvw[1];
+	uvw_p(2,r) = hdr.uvw[2];
+
+	for (Int j = 0; j < ncorr_p; j++)
+	    weight_p(j,r) = hdr.weight[j];
+    }
+}
+
+
+void
+RowBatch::flush (uInt& nextrow)
+{
+    if (ngroup_p == 0)
+	return;
+
+    // When resuming, we overwrite whatever rows were written after the
+    // last checkpoint before we start adding new ones.
+    uInt n = ngroup_p * nspect_p;
+    uInt start = nextrow;
+    if (start + n > ms_p.nrow ())
+	ms_p.addRow (start + n - ms_p.nrow ());
+    nextrow += n;
+
+    Slicer rows (IPosition (1, start), IPosition (1, n));
+    Slice rs (0, n);
+
+    put ("ANTENNA1", msc_p.antenna1 (), rows, ant1_p(rs));
+    put ("ANTENNA2", msc_p.antenna2 (), rows, ant2_p(rs));
+    put ("ARRAY_ID", msc_p.arrayId (), rows, array_p(rs));
+    put ("FIELD_ID", msc_p.fieldId (), rows, field_p(rs));
+    put ("DATA_DESC_ID", msc_p.dataDescId (), rows, ddid_p(rs));
+    put ("SCAN_NUMBER", msc_p.scanNumber (), rows, scan_p(rs));
+    put (MIR_REC_COL, mirreccol_p, rows, recnum_p(rs));
+    if (haslastrec_p)
+	put (MIR_LASTREC_COL, lastreccol_p, rows, lastrec_p(rs));
+    if (hasinput_p)
+	put (MIR_INPUT_COL, inputcol_p, rows, input_p(rs));
+    put ("TIME", msc_p.time (), rows, time_p(rs));
+    put ("TIME_CENTROID", msc_p.timeCentroid (), rows, time_p(rs));
+    put ("EXPOSURE", msc_p.exposure (), rows, exposure_p(rs));
+    put ("INTERVAL", msc_p.interval (), rows, interval_p(rs));
+    put ("FLAG_ROW", msc_p.flagRow (), rows, flagrow_p(rs));
+    put ("UVW", msc_p.uvw (), rows, uvw_p(Slice (), rs));
+    put ("WEIGHT", msc_p.weight (), rows, weight_p(Slice (), rs));
+    put ("SIGMA", msc_p.sigma (), rows, ones_p(Slice (), rs));
+
+    // Each input dataset gets its own OBSERVATION row.
+    put ("OBSERVATION_ID", msc_p.observationId (), rows, input_p(rs));
+
+    // These never vary; with the default ISM binding they cost nothing.
+    put ("FEED1", msc_p.feed1 (), rows, zeros_p(rs));
+    put ("FEED2", msc_p.feed2 (), rows, zeros_p(rs));
+    put ("PROCESSOR_ID", msc_p.processorId (), rows, negones_p(rs));
+    put ("STATE_ID", msc_p.stateId (), rows, negones_p(rs));
+
+    Slice gs (0, ngroup_p);
+
+    for (Int i = 0; i < nspect_p; i++) {
+	RefRows cells (start + i, start + n - nspect_p + i, nspect_p);
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now ();
+
+	{
+	    MirTimer t (mirstats_column (stats_p, "DATA"));
+	    msc_p.data ().putColumnCells (cells, data_p[i](Slice (), Slice (), gs));
+	}
+
+	datasecs_p += std::chrono::duration<Double> (std::chrono::steady_clock::now () - t0).count ();
+	datavalues_p += (Double) cellsize_p[i] * ngroup_p;
+
+	{
+	    MirTimer t (mirstats_column (stats_p, "FLAG"));
+	    msc_p.flag ().putColumnCells (cells, flag_p[i](Slice (), Slice (), gs));
+	}
+
+	// With flagcat=none, FLAG_CATEGORY cells are left undefined, which
+	// is legal for this optional-shape column and costs no storage.
+	if (flagcat_p[i].nelements () == 0)
+	    continue;
+
+	IPosition fcshape = flagcat_p[i].shape ();
+	IPosition fcend = fcshape - 1;
+	fcend(3) = ngroup_p - 1;
+
+	// Plane 0 of FLAG_CATEGORY duplicates FLAG; the others stay False.
+	uInt catsize = cellsize_p[i] * fcshape(2);
+	Bool *fc = flagcat_p[i].data ();
+
+	for (Int g = 0; g < ngroup_p; g++)
+	    memcpy (fc + g * catsize, flagCell (i, g), cellsize_p[i] * sizeof (Bool));
+
+	MirTimer t (mirstats_column (stats_p, "FLAG_CATEGORY"));
+	msc_p.flagCategory ().putColumnCells (cells, flagcat_p[i](IPosition (4, 0), fcend));
+    }
+
+    ngroup_p = 0;
+}
+
+
+// A bounded ring of RowBatches shared by the thread that decodes MIRIAD
+// records and the thread that writes them into the MS, so that we pay the
+// larger of the two costs rather than their sum. The reader fills the batch
+// it's been handed and submits it; the writer flushes submitted batches in
+// order and hands them back. With a single thread there is one batch, which
+// is flushed as soon as it's submitted.
+
+class BatchRing {
+public:
+    BatchRing (MeasurementSet& ms, MSColumns& msc, Int ncorr, Int ncat,
+	       const WINDOW& win, Int ngroups, Int nthreads, uInt startrow,
+	       MirStats *stats);
+    ~BatchRing ();
+
+    RowBatch *first () { return slots_p[0]; }
+    RowBatch *submit (RowBatch *batch);
+    RowBatch *sync (RowBatch *batch);
+    void finish (RowBatch *batch);
+    void abort ();
+
+    // The row after the last one written; only meaningful when the writer
+    // is idle, i.e. after sync () or finish ().
+    uInt nextRow () const { return nextrow_p; }
+
+    // Totals over every batch; only meaningful after finish ().
+    Double dataSeconds () const;
+    Double dataValues () const;
+
+private:
+    void drain ();
+
+    Block<RowBatch *> slots_p;
+    Int nslot_p, head_p, nfull_p;  // the writer's next slot, and the number queued
+    uInt nextrow_p;
+    Bool done_p;
+    String error_p;
+    std::thread writer_p;
+    std::mutex lock_p;
+    std::condition_variable cond_p;
+};
+
+
+BatchRing::BatchRing (MeasurementSet& ms, MSColumns& msc, Int ncorr, Int ncat,
+		      const WINDOW& win, Int ngroups, Int nthreads, uInt startrow,
+		      MirStats *stats)
+{
+    // One batch being written, one being filled, and one of slack.
+    nslot_p = (nthreads > 1) ? 3 : 1;
+    head_p = nfull_p = 0;
+    nextrow_p = startrow;
+    done_p = False;
+
+    slots_p.resize (nslot_p);
+
+    for (Int i = 0; i < nslot_p; i++)
+	slots_p[i] = new RowBatch (ms, msc, ncorr, ncat, win, ngroups, stats);
+
+    if (nslot_p > 1)
+	writer_p = std::thread (&BatchRing::drain, this);
+}
+
+
+BatchRing::~BatchRing ()
+{
+    abort ();
+
+    for (Int i = 0; i < nslot_p; i++)
+	delete slots_p[i];
+}
+
+
+RowBatch *
+BatchRing::submit (RowBatch *batch)
+{
+    if (nslot_p == 1) {
+	batch->flush (nextrow_p);
+	return batch;
+    }
+
+    std::unique_lock<std::mutex> guard (lock_p);
+
+    nfull_p++;
+    cond_p.notify_all ();
+
+    while (nfull_p == nslot_p && error_p.empty ())
+	cond_p.wait (guard);
+
+    if (!error_p.empty ())
+	throw AipsError (error_p);
+
+    return slots_p[(head_p + nfull_p) % nslot_p];
+}
+
+
+// Submit the batch, full or not, and wait for everything to be written.
+
+RowBatch *
+BatchRing::sync (RowBatch *batch)
+{
+    batch = submit (batch);
+
+    if (nslot_p == 1)
+	return batch;
+
+    std::unique_lock<std::mutex> guard (lock_p);
+
+    while (nfull_p > 0 && error_p.empty ())
+	cond_p.wait (guard);
+
+    if (!error_p.empty ())
+	throw AipsError (error_p);
+
+    return batch;
+}
+
+
+void
+BatchRing::finish (RowBatch *batch)
+{
+    if (nslot_p == 1) {
+	batch->flush (nextrow_p);
+	return;
+    }
+
+    {
+	std::lock_guard<std::mutex> guard (lock_p);
+	nfull_p++;
+	done_p = True;
+	cond_p.notify_all ();
+    }
+
+    writer_p.join ();
+
+    if (!error_p.empty ())
+	throw AipsError (error_p);
+}
+
+
+Double
+BatchRing::dataSeconds () const
+{
+    Double t = 0;
+
+    for (Int i = 0; i < nslot_p; i++)
+	t += slots_p[i]->dataSeconds ();
+
+    return t;
+}
+
+
+Double
+BatchRing::dataValues () const
+{
+    Double n = 0;
+
+    for (Int i = 0; i < nslot_p; i++)
+	n += slots_p[i]->dataValues ();
+
+    return n;
+}
+
+
+void
+BatchRing::abort ()
+{
+    if (!writer_p.joinable ())
+	return;
+
+    {
+	std::lock_guard<std::mutex> guard (lock_p);
+	if (error_p.empty ())
+	    error_p = "conversion aborted";
+	cond_p.notify_all ();
+    }
+
+    writer_p.join ();
+}
+
+
+void
+BatchRing::drain ()
+{
+    while (1) {
+	RowBatch *batch;
+
+	{
+	    std::unique_lock<std::mutex> guard (lock_p);
+
+	    while (nfull_p == 0 && !done_p && error_p.empty ())
+		cond_p.wait (guard);
+
+	    if (!error_p.empty () || nfull_p == 0)
+		return;
+
+	    batch = slots_p[head_p];
+	}
+
+	// Anything escaping this thread would terminate us without a word,
+	// so every failure is handed back to the reader.
+	String error;
+	Bool failed = True;
+
+	try {
+	    batch->flush (nextrow_p);
+	    failed = False;
+	} catch (AipsError& x) {
+	    error = x.getMesg ();
+	} catch (std::exception& x) {
+	    error = x.what ();
+	} catch (...) {
+	    error = "unknown exception";
+	}
+
+	std::lock_guard<std::mutex> guard (lock_p);
+
+	if (failed) {
+	    error_p = (error == "") ? String ("error writing to the MS") : error;
+	    cond_p.notify_all ();
+	    return;
+	}
+
+	head_p = (head_p + 1) % nslot_p;
+	nfull_p--;
+	cond_p.notify_all ();
+    }
+}
+
+
+/* Time and channel averaging, done before anything reaches a RowBatch.
+   Groups are decoded at full resolution into our input cells, then summed
+   into a slot for their baseline. When a group arrives that doesn't belong
+   in the current time bin -- it's at least timeavg seconds after the bin
+   started, or before the bin started, as happens in uvcat'd or otherwise
+   unsorted data, or it's from a different array, field, or scan -- every
+   slot is written out as one group, in the order the baselines first
+   appeared.
+
+   Averages are weighted by the group weight and ignore flagged samples; an
+   output sample with nothing unflagged going into it is flagged. WEIGHT is
+   the sum of the weights of the groups that contributed unflagged data to
+   each correlation, as CASA's split does. TIME is the middle of the span
+   of averaged groups, INTERVAL the span itself, and EXPOSURE the sum of
+   their intervals. MIRIAD_RECNUM and MIRIAD_LASTREC give the first and
+   last records averaged in, and so bound all of them. */
+
+class Averager {
+public:
+    Averager (Int ncorr, const WINDOW& win, Int chanavg, Double timeavg,
+	      Int nbaselines, Bool sparse);
+
+    // The full-resolution (corr, chan) cells of the group being decoded.
+    Complex *visCell (Int ifno) { return invis_p[ifno].data (); }
+    Bool *flagCell (Int ifno) { return inflag_p[ifno].data (); }
+
+    void clearInput ();
+    void add (const GroupHeader& hdr, Int antbase, BatchRing& ring, RowBatch *&batch);
+    void flush (BatchRing& ring, RowBatch *&batch);
+
+private:
+    Int ncorr_p, nspect_p, chanavg_p, nslot_p;
+    Double timeavg_p;
+    Bool sparse_p;
+    Block<Int> nin_p, nout_p;          // channels per IF, before and after
+    Block<Matrix<Complex> > invis_p;   // (corr, chan)
+    Block<Matrix<Bool> > inflag_p;
+    Block<Cube<Complex> > sum_p;       // (corr, outchan, slot)
+    Block<Cube<Float> > wsum_p;
+    Block<GroupHeader> slots_p;        // accumulated headers
+    Block<Double> tfirst_p, tlast_p;
+    Block<Int> nint_p, key_p;
+    Block<Int> slotof_p;               // dataset's (ant1 * 256 + ant2) -> slot, or -1
+};
+
+
+Averager::Averager (Int ncorr, const WINDOW& win, Int chanavg, Double timeavg,
+		    Int nbaselines, Bool sparse)
+{
+    ncorr_p = ncorr;
+    nspect_p = win.nspect;
+    chanavg_p = chanavg;
+    timeavg_p = timeavg;
+    sparse_p = sparse;
+    nslot_p = 0;
+
+    nin_p.resize (nspect_p);
+    nout_p.resize (nspect_p);
+    invis_p.resize (nspect_p);
+    inflag_p.resize (nspect_p);
+    sum_p.resize (nspect_p);
+    wsum_p.resize (nspect_p);
+
+    for (Int i = 0; i < nspect_p; i++) {
+	nin_p[i] = win.nschan[i];
+	nout_p[i] = (win.nschan[i] + chanavg - 1) / chanavg;
+	invis_p[i].resize (ncorr, nin_p[i]);
+	inflag_p[i].resize (ncorr, nin_p[i]);
+	sum_p[i].resize (ncorr, nout_p[i], nbaselines);
+	wsum_p[i].resize (ncorr, nout_p[i], nbaselines);
+    }
+
+    slots_p.resize (nbaselines);
+    tfirst_p.resize (nbaselines);
+    tlast_p.resize (nbaselines);
+    nint_p.resize (nbaselines);
+    key_p.resize (nbaselines);
+
+    if (nbaselines > 0) {
+	slotof_p.resize (256 * 256);
+	slotof_p.set (-1);
+    }
+}
+
+
+void
+Averager::clearInput ()
+{
+    // Flag everything, in case the group doesn't cover every correlation.
+    for (Int i = 0; i < nspect_p; i++)
+	inflag_p[i] = True;
+}
+
+
+void
+Averager::add (const GroupHeader& hdr, Int antbase, BatchRing& ring, RowBatch *&batch)
+{
+    if (nslot_p > 0) {
+	const GroupHeader& bin = slots_p[0];
+
+	if (hdr.time < tfirst_p[0] ||
+	    (hdr.time != tfirst_p[0] && hdr.time - tfirst_p[0] >= timeavg_p) ||
+	    hdr.array != bin.array || hdr.field != bin.field || hdr.scan != bin.scan)
+	    flush (ring, batch);
+    }
+
+    // A bin never spans arrays, so the antenna numbers of the dataset
+    // itself, without the array's `antbase` ANTENNA row, are enough to
+    // tell its baselines apart, however many arrays the MS has.
+    Int ant1 = hdr.ant1 - antbase, ant2 = hdr.ant2 - antbase;
+    Int key = ant1 * 256 + ant2;
+    if (ant1 < 0 || ant1 >= 256 || ant2 < 0 || ant2 >= 256)
+	throw AipsError ("cannot average baseline " + String::toString (ant1 + 1) +
+			 "-" + String::toString (ant2 + 1));
+
+    Int s = slotof_p[key];
+
+    if (s < 0) {
+	// More baselines than we planned for: just end the bin early.
+	if (nslot_p == (Int) slots_p.nelements ())
+	    flush (ring, batch);
+
+	s = nslot_p++;
+	slotof_p[key] = s;
+	key_p[s] = key;
+
+	GroupHeader& acc = slots_p[s];
+	acc = hdr;
+	acc.exposure = 0;
+	for (Int j = 0; j < 3; j++)
+	    acc.uvw[j] = 0;
+	for (Int j = 0; j < ncorr_p; j++)
+	    acc.weight[j] = 0;
+
+	tfirst_p[s] = hdr.time;
+	nint_p[s] = 0;
+
+	for (Int i = 0; i < nspect_p; i++) {
+	    sum_p[i].xyPlane (s) = Complex (0);
+	    wsum_p[i].xyPlane (s) = 0;
+	}
+    }
+
+    GroupHeader& acc = slots_p[s];
+    Bool used[4] = { False, False, False, False };
+
+    for (Int i = 0; i < nspect_p; i++) {
+	const Complex *vis = invis_p[i].data ();
+	const Bool *flag = inflag_p[i].data ();
+	Complex *sum = sum_p[i].data () + s * ncorr_p * nout_p[i];
+	Float *wsum = wsum_p[i].data () + s * ncorr_p * nout_p[i];
+
+	for (Int c = 0; c < nin_p[i]; c++) {
+	    Int k = (c / chanavg_p) * ncorr_p;
+
+	    for (Int j = 0; j < ncorr_p; j++) {
+		Float w = hdr.weight[j];
+
+		if (flag[c * ncorr_p + j] || w <= 0)
+		    continue;
+
+		sum[k + j] += vis[c * ncorr_p + j] * w;
+		wsum[k + j] += w;
+		used[j] = True;
+	    }
+	}
+    }
+
+    for (Int j = 0; j < ncorr_p; j++)
+	if (used[j])
+	    acc.weight[j] += hdr.weight[j];
+
+    for (Int j = 0; j < 3; j++)
+	acc.uvw[j] += hdr.uvw[j];
+
+    acc.lastrec = hdr.lastrec;
+    acc.exposure += hdr.interval;
+    tlast_p[s] = hdr.time;
+    nint_p[s]++;
+}
+
+
+void
+Averager::flush (BatchRing& ring, RowBatch *&batch)
+{
+    for (Int s = 0; s < nslot_p; s++) {
+	GroupHeader hdr = slots_p[s];
+	Int g = batch->nextGroup ();
+
+	hdr.time = 0.5 * (tfirst_p[s] + tlast_p[s]);
+	hdr.interval += tlast_p[s] - tfirst_p[s];
+	for (Int j = 0; j < 3; j++)
+	    hdr.uvw[j] /= nint_p[s];
+
+	for (Int i = 0; i < nspect_p; i++) {
+	    Int n = ncorr_p * nout_p[i];
+	    const Complex *sum = sum_p[i].data () + s * n;
+	    const Float *wsum = wsum_p[i].data () + s * n;
+	    Complex *vis = batch->visCell (i, g);
+	    Bool *flag = batch->flagCell (i, g);
+
+	    for (Int k = 0; k < n; k++) {
+		flag[k] = (wsum[k] <= 0);
+		vis[k] = flag[k] ? Complex (0) : sum[k] / wsum[k];
+	    }
+	}
+
+	slotof_p[key_p[s]] = -1;
+
+	if (sparse_p && batch->groupFlagged (g))
+	    continue;
+
+	batch->addGroup (hdr);
+
+	if (batch->full ())
+	    batch = ring.submit (batch);
+    }
+
+    nslot_p = 0;
+}
+
+
+// Make a file to spill sorted groups into. It's unlinked at once, so it
+// goes away when the last descriptor of it is closed.
+
+static int
+make_spill_file (const String& tmpdir)
+{
+    String path = tmpdir + "/mirtoms-sort-XXXXXX";
+    std::vector<char> name (path.chars (), path.chars () + path.length () + 1);
+    int fd;
+
+    if ((fd = mkstemp (&name[0])) < 0)
+	throw AipsError ("cannot create a sort spill file in " + tmpdir);
+
+    unlink (&name[0]);
+    return fd;
+}
+
+
+/* Sorting for sort=time,baseline, which puts the main table in canonical
+   (TIME, ANTENNA1, ANTENNA2, DATA_DESC_ID) order so that CASA doesn't have
+   to. A group's rows are always written together in IF order, and the
+   DATA_DESC_IDs of different spectral setups don't overlap, so it's enough
+   to sort whole groups by time, baseline, and first DATA_DESC_ID, with the
+   input dataset and record number breaking ties so that the order is
+   stable.
+
+   Groups are decoded straight into the next slot of a buffer of at most
+   `membytes`, and only their keys are sorted. If the whole dataset fits,
+   the slots are written out in key order at the end. If it doesn't, each
+   time the buffer fills its groups are written in key order to a spill
+   file as one sorted run, and at the end the runs are merged, each read
+   sequentially through its share of the buffer.
+
+   At most MAX_FANIN runs are merged at once, fewer if the buffer can't
+   give each of them a slot, so the merge stays within the buffer.
+   Whenever that many runs of the same generation pile up, they're merged
+   into one run of the next, so the spill files open at once only grow
+   with the number of generations: under a hundred for 32 thousand
+   buffers' worth of data. At the end the smallest runs are merged until
+   few enough are left for the final pass. Spill files are unlinked as
+   soon as they're created, so nothing is left behind if we die.
+
+   With several inputs, each input's converter but the last passes its
+   groups on in key order, appending them as one run to a spill file that
+   convert_inputs shares between them, and the last converter adopts
+   those runs as if it had spilled them itself, so that rows of all of
+   the inputs are merged into one order.
+   MIRIAD_RECNUM travels with each row, so the records can still be found;
+   mirmsflagextract uses it to walk the MS in record order. */
+
+class GroupSorter {
+public:
+    GroupSorter (Int ncorr, const WINDOW& win, size_t membytes, const String& tmpdir,
+		 MirStats *stats);
+    ~GroupSorter ();
+
+    // The (corr, chan) cells of the group being decoded.
+    Complex *visCell (Int ifno) { return (Complex *) (slot (nused_p) + visoff_p[ifno]); }
+    Bool *flagCell (Int ifno) { return (Bool *) (slot (nused_p) + flagoff_p[ifno]); }
+
+    void clearInput ();
+    Bool inputFlagged () const;
+    void add (const GroupHeader& hdr);
+    void flush (BatchRing& ring, RowBatch *&batch);
+
+    // Instead of flush (), append all of the groups in order to `fd` as
+    // one run for another GroupSorter to adopt.
+    void passOn (int fd);
+
+    // Take bytes [begin, end) of `fd`, a run passed on by another
+    // GroupSorter, as one of ours. Returns the number of groups in it.
+    size_t adopt (int fd, Int64 begin, Int64 end);
+
+    // Number of sorted runs spilled to disk, and of merges of runs into
+    // longer ones before the final merge.
+    Int nruns () const { return nspilled_p; }
+    Int nmerges () const { return nmerged_p; }
+
+    // The most runs merged in one pass.
+    static const Int MAX_FANIN = 32;
+
+private:
+    struct Key {
+	Double time;
+	Int ant1, ant2, spwbase, input, recnum;
+	Int slot;   // in the buffer, or while merging, the run
+
+	bool operator< (const Key& o) const
+	{
+	    if (time != o.time)
+		return time < o.time;
+	    if (ant1 != o.ant1)
+		return ant1 < o.ant1;
+	    if (ant2 != o.ant2)
+		return ant2 < o.ant2;
+	    if (spwbase != o.spwbase)
+		return spwbase < o.spwbase;
+	    if (input != o.input)
+		return input < o.input;
+	    return recnum < o.recnum;
+	}
+    };
+
+    char *slot (size_t s) { return &buf_p[0] + s * groupbytes_p; }
+    const char *slot (size_t s) const { return &buf_p[0] + s * groupbytes_p; }
+    static Key keyOf (const char *rec, Int slot);
+    void grow ();
+    FILE *newRun ();
+    void spill ();
+    void collapse ();
+    void addRun (FILE *f, Int64 pos, size_t ngroup, Int gen);
+    void fill (Int run, Int share, size_t per, size_t& avail);
+    void emit (const char *rec, BatchRing& ring, RowBatch *&batch);
+    size_t merge (Int first, FILE *out, BatchRing *ring, RowBatch **batch);
+    void mergeInto (Int first);
+    void narrow ();
+
+    Int nspect_p;
+    Block<Int> cellsize_p;
+    Block<size_t> visoff_p, flagoff_p; // of each IF's cells within a slot
+    size_t groupbytes_p, nslot_p, nused_p;
+    Int fanin_p, nspilled_p, nmerged_p;
+    std::vector<char> buf_p;           // slots: GroupHeader, then vis, then flags
+    std::vector<Key> keys_p;
+    std::vector<FILE *> runs_p;
+    std::vector<Int64> runpos_p;       // where each run's next group is in its file
+    std::vector<size_t> runleft_p;     // groups of each run not yet read back
+    std::vector<Int> rungen_p;         // merges each run's groups have been through
+    String tmpdir_p;
+    MirPhase *sortphase_p, *spillphase_p, *mergephase_p;
+};
+
+
+GroupSorter::GroupSorter (Int ncorr, const WINDOW& win, size_t membytes,
+			  const String& tmpdir, MirStats *stats)
+{
+    nspect_p = win.nspect;
+    tmpdir_p = tmpdir;
+    sortphase_p = mirstats_phase (stats, "sort");
+    spillphase_p = mirstats_phase (stats, "sort_spill");
+    mergephase_p = mirstats_phase (stats, "sort_merge");
+
+    cellsize_p.resize (nspect_p);
+    visoff_p.resize (nspect_p);
+    flagoff_p.resize (nspect_p);
+
+    size_t off = sizeof (GroupHeader);
+
+    for (Int i = 0; i < nspect_p; i++) {
+	cellsize_p[i] = ncorr * win.nschan[i];
+	visoff_p[i] = off;
+	off += cellsize_p[i] * sizeof (Complex);
+    }
+
+    for (Int i = 0; i < nspect_p; i++) {
+	flagoff_p[i] = off;
+	off += cellsize_p[i] * sizeof (Bool);
+    }
+
+    // Keep every slot's header aligned.
+    groupbytes_p = (off + 7) & ~(size_t) 7;
+
+    // A zero budget means that we're not sorting at all. Otherwise the
+    // buffer grows as needed, so sorting a small dataset with a big
+    // budget doesn't cost the whole budget.
+    nslot_p = membytes ? max (membytes / groupbytes_p, (size_t) 1) : 0;
+    nused_p = 0;
+    nspilled_p = 0;
+    nmerged_p = 0;
+
+    // Each run being merged needs at least one slot, though a merge of
+    // fewer than two runs gets nowhere.
+    fanin_p = (Int) max (min (nslot_p, (size_t) MAX_FANIN), (size_t) 2);
+
+    if (nslot_p > 0)
+	buf_p.resize (min (nslot_p, (size_t) 64) * groupbytes_p);
+}
+
+
+GroupSorter::~GroupSorter ()
+{
+    for (size_t i = 0; i < runs_p.size (); i++)
+	fclose (runs_p[i]);
+}
+
+
+void
+GroupSorter::clearInput ()
+{
+    // Flag everything, in case the group doesn't cover every correlation.
+    for (Int i = 0; i < nspect_p; i++) {
+	Complex *v = visCell (i);
+	Bool *f = flagCell (i);
+
+	for (Int j = 0; j < cellsize_p[i]; j++) {
+	    v[j] = 0;
+	    f[j] = True;
+	}
+    }
+}
+
+
+Bool
+GroupSorter::inputFlagged () const
+{
+    const char *rec = slot (nused_p);
+
+    for (Int i = 0; i < nspect_p; i++) {
+	const Bool *f = (const Bool *) (rec + flagoff_p[i]);
+
+	for (Int j = 0; j < cellsize_p[i]; j++)
+	    if (!f[j])
+		return False;
+    }
+
+    return True;
+}
+
+
+GroupSorter::Key
+GroupSorter::keyOf (const char *rec, Int slot)
+{
+    const GroupHeader *hdr = (const GroupHeader *) rec;
+    Key k;
+
+    k.time = hdr->time;
+    k.ant1 = hdr->ant1;
+    k.ant2 = hdr->ant2;
+    k.spwbase = hdr->spwbase;
+    k.input = hdr->input;
+    k.recnum = hdr->recnum;
+    k.slot = slot;
+    return k;
+}
+
+
+void
+GroupSorter::add (const GroupHeader& hdr)
+{
+    memcpy (slot (nused_p), &hdr, sizeof (hdr));
+    keys_p.push_back (keyOf (slot (nused_p), nused_p));
+    nused_p++;
+
+    if (nused_p == nslot_p)
+	spill ();
+    else if ((nused_p + 1) * groupbytes_p > buf_p.size ())
+	grow ();
+}
+
+
+void
+GroupSorter::grow ()
+{
+    size_t n = buf_p.size () / groupbytes_p;
+
+    buf_p.resize (min (2 * n, nslot_p) * groupbytes_p);
+}
+
+
+FILE *
+GroupSorter::newRun ()
+{
+    int fd = make_spill_file (tmpdir_p);
+    FILE *f;
+
+    if ((f = fdopen (fd, "w+b")) == NULL) {
+	close (fd);
+	throw AipsError ("cannot create a sort spill file in " + tmpdir_p);
+    }
+
+    return f;
+}
+
+
+void
+GroupSorter::addRun (FILE *f, Int64 pos, size_t ngroup, Int gen)
+{
+    runs_p.push_back (f);
+    runpos_p.push_back (pos);
+    runleft_p.push_back (ngroup);
+    rungen_p.push_back (gen);
+}
+
+
+void
+GroupSorter::spill ()
+{
+    {
+	MirTimer t (spillphase_p);
+	FILE *f;
+
+	std::sort (keys_p.begin (), keys_p.end ());
+
+	f = newRun ();
+	addRun (f, 0, keys_p.size (), 0);
+	nspilled_p++;
+
+	for (size_t i = 0; i < keys_p.size (); i++)
+	    if (fwrite (slot (keys_p[i].slot), groupbytes_p, 1, f) != 1)
+		throw AipsError ("error writing a sort spill file in " + tmpdir_p +
+				 "; is it full?");
+
+	if (fflush (f) != 0)
+	    throw AipsError ("error writing a sort spill file in " + tmpdir_p + "; is it full?");
+
+	keys_p.clear ();
+	nused_p = 0;
+    }
+
+    collapse ();
+}
+
+
+// Merge the newest runs while the last fanin_p of them are of the same
+// generation. Older generations are never smaller, so the runs stay in
+// order of generation, and there are at most fanin_p - 1 of each.
+
+void
+GroupSorter::collapse ()
+{
+    for (;;) {
+	Int nrun = runs_p.size ();
+
+	if (nrun < fanin_p || rungen_p[nrun - fanin_p] != rungen_p[nrun - 1])
+	    return;
+
+	MirTimer t (mergephase_p);
+	mergeInto (nrun - fanin_p);
+    }
+}
+
+
+// Read the next groups of a run into its share of the buffer, the
+// share'th `per` slots.
+
+void
+GroupSorter::fill (Int run, Int share, size_t per, size_t& avail)
+{
+    avail = min (per, runleft_p[run]);
+
+    // Runs passed on from other inputs share a file, and with it a file
+    // position, so we read at our own offsets rather than through stdio.
+    size_t nbytes = avail * groupbytes_p, got = 0;
+    char *dest = slot (share * per);
+
+    while (got < nbytes) {
+	ssize_t n = pread (fileno (runs_p[run]), dest + got, nbytes - got, runpos_p[run] + got);
+
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    throw AipsError ("error reading back a sort spill file in " + tmpdir_p);
+	got += n;
+    }
+
+    runpos_p[run] += (Int64) avail * groupbytes_p;
+    runleft_p[run] -= avail;
+}
+
+
+void
+GroupSorter::emit (const char *rec, BatchRing& ring, RowBatch *&batch)
+{
+    Int g = batch->nextGroup ();
+
+    for (Int i = 0; i < nspect_p; i++) {
+	memcpy (batch->visCell (i, g), rec + visoff_p[i], cellsize_p[i] * sizeof (Complex));
+	memcpy (batch->flagCell (i, g), rec + flagoff_p[i], cellsize_p[i] * sizeof (Bool));
+    }
+
+    batch->addGroup (*(const GroupHeader *) rec);
+
+    if (batch->full ())
+	batch = ring.submit (batch);
+}
+
+
+/* Merge runs `first` onward through a heap of their next groups, each
+   run read through its share of the buffer, and close them. The merged
+   groups go to the batches if `out` is NULL, or otherwise are appended
+   to `out`. Returns the number of groups. The buffer holds nothing else
+   while we're merging, so it's ours to reuse. */
+
+size_t
+GroupSorter::merge (Int first, FILE *out, BatchRing *ring, RowBatch **batch)
+{
+    Int nrun = runs_p.size () - first;
+    size_t per = max (nslot_p / nrun, (size_t) 1), total = 0;
+    std::vector<size_t> avail (nrun), pos (nrun, 0);
+    std::vector<Key> heap;
+    auto later = [] (const Key& a, const Key& b) { return b < a; };
+
+    buf_p.resize (nrun * per * groupbytes_p);
+
+    for (Int r = 0; r < nrun; r++) {
+	total += runleft_p[first + r];
+	fill (first + r, r, per, avail[r]);
+
+	if (avail[r] > 0)
+	    heap.push_back (keyOf (slot (r * per), r));
+    }
+
+    std::make_heap (heap.begin (), heap.end (), later);
+
+    while (!heap.empty ()) {
+	std::pop_heap (heap.begin (), heap.end (), later);
+	Int r = heap.back ().slot;
+	heap.pop_back ();
+
+	const char *rec = slot (r * per + pos[r]);
+
+	if (out == NULL)
+	    emit (rec, *ring, *batch);
+	else if (fwrite (rec, groupbytes_p, 1, out) != 1)
+	    throw AipsError ("error writing a sort spill file in " + tmpdir_p + "; is it full?");
+
+	if (++pos[r] == avail[r]) {
+	    fill (first + r, r, per, avail[r]);
+	    pos[r] = 0;
+	}
+
+	if (pos[r] < avail[r]) {
+	    heap.push_back (keyOf (slot (r * per + pos[r]), r));
+	    std::push_heap (heap.begin (), heap.end (), later);
+	}
+    }
+
+    for (Int r = first; r < (Int) runs_p.size (); r++)
+	fclose (runs_p[r]);
+
+    runs_p.resize (first);
+    runpos_p.resize (first);
+    runleft_p.resize (first);
+    rungen_p.resize (first);
+
+    if (out != NULL && fflush (out) != 0)
+	throw AipsError ("error writing a sort spill file in " + tmpdir_p + "; is it full?");
+
+    return total;
+}
+
+
+// Merge runs `first` onward into a new run.
+
+void
+GroupSorter::mergeInto (Int first)
+{
+    FILE *out = newRun ();
+    Int gen = rungen_p[first];
+    size_t total;
+
+    try {
+	total = merge (first, out, NULL, NULL);
+    } catch (...) {
+	fclose (out);
+	throw;
+    }
+
+    addRun (out, 0, total, gen + 1);
+    nmerged_p++;
+}
+
+
+// Merge the newest, and so smallest, runs into one until the rest can be
+// merged in a single pass.
+
+void
+GroupSorter::narrow ()
+{
+    while ((Int) runs_p.size () > fanin_p) {
+	Int nrun = runs_p.size ();
+	Int n = min (fanin_p, nrun - fanin_p + 1);
+
+	mergeInto (nrun - n);
+    }
+}
+
+
+void
+GroupSorter::flush (BatchRing& ring, RowBatch *&batch)
+{
+    if (runs_p.empty ()) {
+	{
+	    MirTimer t (sortphase_p);
+	    std::sort (keys_p.begin (), keys_p.end ());
+	}
+
+	for (size_t i = 0; i < keys_p.size (); i++)
+	    emit (slot (keys_p[i].slot), ring, batch);
+
+	keys_p.clear ();
+	nused_p = 0;
+	return;
+    }
+
+    if (nused_p > 0)
+	spill ();
+
+    MirTimer t (mergephase_p);
+
+    // Then merge what's left straight into batches.
+    narrow ();
+    merge (0, NULL, &ring, &batch);
+}
+
+
+void
+GroupSorter::passOn (int fd)
+{
+    if (nused_p > 0)
+	spill ();
+
+    if (runs_p.empty ())
+	return;
+
+    MirTimer t (mergephase_p);
+    int outfd = dup (fd);
+    FILE *out;
+
+    if (outfd < 0 || (out = fdopen (outfd, "r+b")) == NULL) {
+	if (outfd >= 0)
+	    close (outfd);
+	throw AipsError ("cannot pass sorted groups on through a spill file in " + tmpdir_p);
+    }
+
+    try {
+	if (fseeko (out, 0, SEEK_END) != 0)
+	    throw AipsError ("cannot pass sorted groups on through a spill file in " + tmpdir_p);
+
+	narrow ();
+	merge (0, out, NULL, NULL);
+    } catch (...) {
+	fclose (out);
+	throw;
+    }
+
+    if (fclose (out) != 0)
+	throw AipsError ("error writing a sort spill file in " + tmpdir_p + "; is it full?");
+}
+
+
+size_t
+GroupSorter::adopt (int fd, Int64 begin, Int64 end)
+{
+    if (end <= begin)
+	return 0;
+
+    if ((end - begin) % groupbytes_p != 0)
+	throw AipsError ("sorted groups passed on from another input don't have our layout");
+
+    int infd = dup (fd);
+    FILE *f;
+
+    if (infd < 0 || (f = fdopen (infd, "rb")) == NULL) {
+	if (infd >= 0)
+	    close (infd);
+	throw AipsError ("cannot read sorted groups passed on from another input");
+    }
+
+    size_t n = (end - begin) / groupbytes_p;
+
+    addRun (f, begin, n, 0);
+    collapse ();
+    return n;
+}
+
+
+// Command-line settings that affect how the main table is filled.
+
+struct FillOptions {
+    Int snumbase;   // starting SCAN_NUMBER
+    Int batchrows;  // rows per RowBatch; 0 for automatic
+    Int nthreads;
+    Int recbegin;   // only write groups whose first record is in [recbegin,recend);
+    Int recend;     // recend < 0 means no upper limit
+    Bool quiet;     // don't print the summary line
+    Bool flagcat;   // write FLAG_CATEGORY cells, or leave them undefined
+    Bool sparse;    // omit groups whose data are entirely flagged
+    Int chanavg;    // channels to average together; 1 for none
+    Double timeavg; // seconds to average over; 0 for none
+    Int checkpoint; // records between checkpoints; 0 for none
+    Bool resume;    // continue from the MS's last checkpoint
+    Bool append;    // add to an existing MS rather than creating one
+    uInt startrow;  // first MS row to write
+    Bool useindex;  // use (and if need be, build) the dataset's record index
+    Bool sort;      // write rows in (time, baseline) order, not record order
+    size_t sortmem; // bytes of groups to sort in memory before spilling
+    String sorttmp; // directory for sort spill files
+    int sortfd;     // with several inputs, the spill file their sorted groups meet in, or -1
+    Bool sortpass;  // append our sorted groups to sortfd rather than writing rows
+    std::vector<Int64> sortruns; // [begin, end) offsets in sortfd of earlier inputs' groups
+};
+
+
+// Omitted MIRIAD records are kept as a flat list of [begin, end) pairs in
+// increasing order, so a run of flagged groups only costs two numbers.
+
+static void
+add_omitted (std::vector<Int>& ranges, Int begin, Int end)
+{
+    if (!ranges.empty () && ranges.back () == begin)
+	ranges.back () = end;
+    else {
+	ranges.push_back (begin);
+	ranges.push_back (end);
+    }
+}
+
+
+// Command-line settings that affect how the MS is laid out on disk.
+
+enum Layout {
+    LAYOUT_ISM_LEGACY,     // everything but DATA/FLAG/UVW in one ISM
+    LAYOUT_BALANCED,       // per-row scalars in SSM, slow-changing ones in ISM
+    LAYOUT_READ_OPTIMIZED  // as balanced, with big buckets and tiled WEIGHT/SIGMA
+};
+
+struct StorageOptions {
+    Layout layout;
+    Int tilechan;   // channels per DATA/FLAG tile; 0 for automatic
+    Int tilerows;   // rows per DATA tile; 0 for automatic
+    Int tilebytes;  // target DATA tile size
+    Bool mmap;      // use memory-mapped rather than cached TSM access
+    Bool compress;  // store DATA as scaled 16-bit integers
+};
+
+
+// Tile shapes for the DATA, FLAG, and UVW hypercolumns, and the cache
+// size that lets us write them a row at a time without thrashing. Huge
+// tiles or many IFs could ask for more memory than is sensible, or than
+// the TSM accessor can be told about, so the cache is capped.
+
+const uInt64 MAX_CACHE_BYTES = (uInt64) 1 << 30;
+
+struct TilePlan {
+    IPosition data, flag, uvw;
+    uInt64 cachebytes;
+};
+
+
+static TilePlan
+plan_tiles (Int npol, Int nchan, Int nspect, Int rowsperint, const StorageOptions& opts)
+{
+    TilePlan plan;
+    Int target = max (opts.tilebytes, (Int) (npol * sizeof (Complex)));
+    Int tchan = nchan, trows;
+
+    /* Aim for DATA tiles that cover a good part of an integration, so that
+       channel-wise reads (flagging) don't touch a tile for every row, then
+       fit in as many channels as we can, so that row-wise reads (imaging)
+       touch as few tiles as possible. */
+
+    if (opts.tilechan > 0)
+	tchan = min (opts.tilechan, nchan);
+    else {
+	Int rowgoal = max (min (rowsperint, 128), 8);
+
+	while (tchan > 1 && (Int64) npol * tchan * rowgoal * sizeof (Complex) > (uInt) target)
+	    tchan = (tchan + 1) / 2;
+    }
+
+    if (opts.tilerows > 0)
+	trows = opts.tilerows;
+    else
+	trows = max (target / (Int) (npol * tchan * sizeof (Complex)), 1);
+
+    // TSM stores Bools as bits, so the FLAG tiles can afford more rows.
+    plan.data = IPosition (3, npol, tchan, trows);
+    plan.flag = IPosition (3, npol, tchan, trows * 8);
+    plan.uvw = IPosition (2, 3, max (target / (Int) (3 * sizeof (Double)), 1024));
+
+    // Writing row by row, we need one band of tiles across the channel
+    // axis for each IF's hypercube to stay in the cache.
+    Int nband = (nchan + tchan - 1) / tchan;
+    plan.cachebytes = (uInt64) nspect * nband * npol * tchan * trows * sizeof (Complex);
+    plan.cachebytes = min (plan.cachebytes, MAX_CACHE_BYTES);
+
+    return plan;
+}
+
+
+// Sources and fields as we discover them, in order of first appearance,
+// with hash indices so that looking one up doesn't mean scanning them all.
+// A field is a distinct (source, dra, ddec) combination; its RA and Dec
+// are those of the source when the field was first seen.
+
+struct SourceInfo {
+    String name;
+    String purpose;
+    Double ra, dec;   // from the first record with no dra/ddec offset
+};
+
+struct FieldKey {
+    Int source;
+    Float dra, ddec;  // radians
+
+    bool operator== (const FieldKey& other) const
+    {
+	return source == other.source && dra == other.dra && ddec == other.ddec;
+    }
+};
+
+struct FieldKeyHash {
+    size_t operator() (const FieldKey& key) const
+    {
+	// Adding 0 turns -0 into +0, which compares equal and so must hash
+	// the same.
+	Float dra = key.dra + 0.f, ddec = key.ddec + 0.f;
+	uInt a, b;
+
+	memcpy (&a, &dra, sizeof (a));
+	memcpy (&b, &ddec, sizeof (b));
+	return std::hash<uInt64> () (((uInt64) a << 32 | b) ^ ((uInt64) key.source * 0x9e3779b97f4a7c15ULL));
+    }
+};
+
+// An array configuration: a set of rows in the ANTENNA table that any
+// number of input datasets with the same antennas can share.
 
-#include <miriad-c/maxdimc.h>
-#include <miriad-c/miriad.h>
+struct ArrayInfo {
+    String telescope;
+    Int nants;
+    std::vector<Double> antpos;
+    Int antbase;      // ANTENNA row of its first antenna
+};
 
 
-#ifndef MAXFIELD
-# define MAXFIELD 256 // TODO: kill this hardcoding.
-#endif
+// A distinct spectral setup, which gets its own block of SPECTRAL_WINDOW
+// and DATA_DESCRIPTION rows. Frequencies are converted to LSRK using the
+// time and pointing at the end of the first input that used it.
 
-#define WARN(message) (cerr << "warning: " << message << endl);
+struct SpwSet {
+    WINDOW win;
+    Double time, ra, dec;
+    Bool done;        // have time, ra and dec been noted?
+};
 
-const char *MIR_REC_COL = "MIRIAD_RECNUM";
 
+// The Tsys of each antenna at the end of an input, for SYSCAL.
 
-typedef struct window {
-    // CASA defines everything mid-band, mid-interval
-    int    nspect;                   // number of valid windows (<=MAXWIN, typically 16)
-    int    nschan[MAXWIN+MAXWIDE];   // number of channels in a window
-    int    ischan[MAXWIN+MAXWIDE];   // starting channel of a window (1-based)
-    double sdf[MAXWIN+MAXWIDE];      // channel separation
-    double sfreq[MAXWIN+MAXWIDE];    // frequency of first channel in window (doppler changes)
-    double restfreq[MAXWIN+MAXWIDE]; // rest freq, if appropriate
-    char   code[MAXWIN+MAXWIDE];     // code to CASA identification (N, W or S; S not used anymore)
+struct SyscalInfo {
+    Int antbase;
+    Double time;
+    std::vector<Float> tsys;
+};
 
-    int    nwide;                    // number of wide band channels
-    float  wfreq[MAXWIDE];           // freq
-    float  wwidth[MAXWIDE];          // width
-} WINDOW;
+
+struct FieldInfo {
+    FieldKey key;
+    Double ra, dec;   // radians, before the offset
+};
 
 
 class Converter {
 public:
-    Converter (String& infile, Int debug_level=0, Bool apply_tsys=False);
+    Converter (String& infile, Int debug_level=0, Bool apply_tsys=False,
+	       const MirIndex *index=0, MirStats *stats=0);
 
     void checkInput ();
-    void setupMeasurementSet (const String& ms_path);
+    void setAveraging (Int chanavg, Double timeavg);
+    void setupMeasurementSet (const String& ms_path, const StorageOptions& opts);
+    void reopenMeasurementSet (const String& ms_path, FillOptions& opts);
+    void appendMeasurementSet (const String& ms_path, FillOptions& opts);
+    void markComplete ();
+    void saveState ();
     void fillObsTables ();
-    void fillMSMainTable (Int snumbase);
+    void selectArray ();
+    void fillMSMainTable (const FillOptions& opts);
     void fillAntennaTable ();
     void fillSyscalTable ();
     void fillSpectralWindowTable ();
@@ -86,9 +1639,22 @@ public:
     void fixEpochReferences ();
 
 private:
+    void finishInput ();
+    void selectWindows ();
+    void addInputColumn (MeasurementSet& ms, Bool legacy);
+    void loadState (const TableRecord& state);
     void setup_tracking ();
     void track_updates ();
     void init_window_info ();
+    Int sourceIndex (const String& name);
+    bool skip_record ();
+    void refresh_vars ();
+    Bool averaging () const { return chanavg_p > 1 || timeavg_p > 0; }
+    WINDOW outputWindow () const { return outputWindow (win); }
+    WINDOW outputWindow (const WINDOW& in) const;
+    void writeCheckpoint (const FillOptions& opts, Int nextrec, uInt nrow, Int iscan,
+			  Int ifield_old, const std::vector<Int>& omitted);
+    void checkResumeState (Int iscan, Int ifield_old);
 
     bool uv_hasvar (const char *varname);
     char *uv_getstr (const char *varname);
@@ -98,6 +1664,7 @@ private:
     void uv_getfloats (const char *varname, float *dest, int count);
     void uv_getdoubles (const char *varname, double *dest, int count);
 
+    std::vector<String> oldinputs_p; // absolute paths of the inputs already in the MS
     String infile_p;
     Int uv_handle_p;
     MeasurementSet ms_p;
@@ -112,23 +1679,42 @@ private:
     Int num_arrays;
     Block<Int> nAnt_p;
     Block<Vector<Double> > receptorAngle_p;
+    std::vector<ArrayInfo> arrays_p;
+    Int curarray_p;
+    std::vector<SpwSet> spwsets_p;
+    Int spwset_p;
+    size_t nspwold_p;         // spwsets_p already in the MS
+    std::vector<Int> nantold_p; // nAnt_p of the arrays already in the MS
+    Int nextscan_p;           // SCAN_NUMBER after the last one written
+    std::vector<SyscalInfo> syscal_p;
     Vector<Double> arrayXYZ_p; // 3 elements
-    Vector<Double> ras_p, decs_p; // ra/dec for source list (source_p)
-    Vector<String> source_p, purpose_p; // list of source names (?? object_p ??)
+    std::vector<SourceInfo> sources_p;
+    std::unordered_map<std::string, Int> sourceindex_p;
+    std::vector<FieldInfo> fields_p;
+    std::unordered_map<FieldKey, Int, FieldKeyHash> fieldindex_p;
 
     // the following variables are for miriad, hence not Double/Int/Float
 
     double preamble[5], first_time;
-    int ifield, nfield, npoint, nsource;     // both dra/ddec should become Vector's
-    float dra[MAXFIELD], ddec[MAXFIELD];       // offset in radians
-    double ra[MAXFIELD], dec[MAXFIELD];
-    int field[MAXFIELD];                     // source index
-    int sid_p[MAXFIELD];
+    int ifield, npoint;
     float dra_p, ddec_p;
+
+    // Variables we look at for every record or group; see mirvars.h.
+    MirVar<double> timevar_p;
+    MirVar<float> baselinevar_p;
+    MirVar<int> polvar_p, npolvar_p;
+    MirVarHandle inttimevar_p, antposvar_p, systempvar_p, wsystempvar_p;
+    MirVarHandle sourcevar_p, offsetvar_p; // offsetvar_p is dra and ddec
     int pol_p;
 
     Vector<Int> polmapping;
     Int nants_p, nchan_p, nwide_p, npol_p;
+    Bool compress_p;          // is DATA stored through CompressComplex?
+    Int chanavg_p;            // channels averaged into each output channel
+    Double timeavg_p;         // seconds averaged into each output row
+    TableRecord checkpoint_p; // what we're resuming from, if anything
+    const MirIndex *index_p;  // the dataset's record index, if we have it
+    MirStats *stats_p;        // where to time things, if anywhere
     Double antpos[3*MAXANT];
     double longitude;
     Double ra_p, dec_p;       // current pointing center RA,DEC at EPOCH
@@ -146,24 +1732,116 @@ private:
 };
 
 
-Converter::Converter (String& infile, Int debug_level, Bool apply_tsys)
+Converter::Converter (String& infile, Int debug_level, Bool apply_tsys,
+		      const MirIndex *index, MirStats *stats)
 {
+    stats_p = stats;
     num_arrays = 0;
-    nfield = 0;
+    curarray_p = 0;
+    spwset_p = 0;
+    nspwold_p = 0;
+    nextscan_p = 0;
     npoint = 0;
 
-    infile_p = infile;
     this->debug_level = debug_level;
     this->apply_tsys = apply_tsys;
+    chanavg_p = 1;
+    timeavg_p = 0;
 
     if (sizeof (double) != sizeof (Double))
 	WARN ("sizeof(Double) != sizeof(double); mirtoms will probably fail");
     if (sizeof (int) != sizeof (Int))
 	WARN ("sizeof(Int) != sizeof(int); mirtoms will probably fail");
 
+    infile_p = infile;
+    index_p = index;
+
     uvopen_c (&uv_handle_p, infile_p.chars (), "old");
     uvset_c (uv_handle_p, "preamble", "uvw/time/baseline", 0, 0.0, 0.0, 0.0);
     setup_tracking ();
+
+    timevar_p.attach (uv_handle_p, "time");
+    baselinevar_p.attach (uv_handle_p, "baseline");
+    polvar_p.attach (uv_handle_p, "pol");
+    npolvar_p.attach (uv_handle_p, "npol");
+    inttimevar_p.attach (uv_handle_p, "inttime");
+    antposvar_p.attach (uv_handle_p, "antpos");
+    systempvar_p.attach (uv_handle_p, "systemp");
+    wsystempvar_p.attach (uv_handle_p, "wsystemp");
+    sourcevar_p.attach (uv_handle_p, "source");
+    offsetvar_p.attach (uv_handle_p, "dra");
+    offsetvar_p.attach (uv_handle_p, "ddec");
+}
+
+
+// Note what SYSCAL and SPECTRAL_WINDOW need from the end of an input.
+
+void
+Converter::finishInput ()
+{
+    SyscalInfo sc;
+    sc.antbase = arrays_p[curarray_p].antbase;
+    sc.time = time_p;
+    sc.tsys.assign (systemp, systemp + nants_p);
+    syscal_p.push_back (sc);
+
+    SpwSet& set = spwsets_p[spwset_p];
+
+    if (!set.done) {
+	set.time = time_p;
+	set.ra = ra_p;
+	set.dec = dec_p;
+	set.done = True;
+    }
+}
+
+
+// Use the array of an earlier input with the same antennas, or add one.
+
+void
+Converter::selectArray ()
+{
+    for (size_t i = 0; i < arrays_p.size (); i++) {
+	const ArrayInfo& arr = arrays_p[i];
+
+	if (arr.telescope == telescope_name && arr.nants == nants_p &&
+	    std::equal (antpos, antpos + 3 * nants_p, arr.antpos.begin ())) {
+	    curarray_p = i;
+	    return;
+	}
+    }
+
+    fillAntennaTable ();
+}
+
+
+// Likewise for the spectral setup.
+
+void
+Converter::selectWindows ()
+{
+    for (size_t i = 0; i < spwsets_p.size (); i++) {
+	const WINDOW& w = spwsets_p[i].win;
+	Bool same = (w.nspect == win.nspect);
+
+	for (Int j = 0; same && j < win.nspect; j++)
+	    same = (w.nschan[j] == win.nschan[j] && w.sfreq[j] == win.sfreq[j] &&
+		    w.sdf[j] == win.sdf[j] && w.restfreq[j] == win.restfreq[j] &&
+		    w.code[j] == win.code[j]);
+
+	if (same) {
+	    spwset_p = i;
+	    return;
+	}
+    }
+
+    SpwSet set;
+    set.win = win;
+    set.time = set.ra = set.dec = 0;
+    set.done = False;
+
+    spwset_p = spwsets_p.size ();
+    spwsets_p.push_back (set);
 }
 
 
@@ -245,6 +1923,11 @@ Converter::checkInput ()
 	nwide_p = 0;
     }
 
+    // Better to find this out now than after writing most of the MS.
+    if (index_p && index_p->hdr.maxnchan != nchan_p)
+	throw AipsError ("cannot handle nchan changing from " + String::toString (nchan_p) +
+			 " to " + String::toString (index_p->hdr.maxnchan));
+
     // Get the initial array configuration
     nants_p = uv_getint ("nants");
     uv_getdoubles ("antpos", antpos, 3 * nants_p);
@@ -327,7 +2010,35 @@ Converter::checkInput ()
 
 
 void
-Converter::setupMeasurementSet (const String& ms_path)
+Converter::setAveraging (Int chanavg, Double timeavg)
+{
+    if (chanavg < 1)
+	throw AipsError ("chanavg= must be at least 1");
+    if (timeavg < 0)
+	throw AipsError ("timeavg= must not be negative");
+
+    chanavg_p = chanavg;
+    timeavg_p = timeavg;
+}
+
+
+// The spectral windows as they appear in the MS, after channel averaging.
+// A last partial bin of channels still makes an output channel.
+
+WINDOW
+Converter::outputWindow (const WINDOW& in) const
+{
+    WINDOW out = in;
+
+    for (Int i = 0; i < in.nspect; i++)
+	out.nschan[i] = (in.nschan[i] + chanavg_p - 1) / chanavg_p;
+
+    return out;
+}
+
+
+void
+Converter::setupMeasurementSet (const String& ms_path, const StorageOptions& opts)
 {
     // Begin cargo-cult programming.
 
@@ -336,72 +2047,629 @@ Converter::setupMeasurementSet (const String& ms_path)
     td.removeColumn (MS::columnName (MS::FLAG));
     MS::addColumnToDesc (td, MS::FLAG, 2);
 
-    td.defineHypercolumn ("TiledData", 3, stringToVector (MS::columnName (MS::DATA)));
+    /* With compress=lossy, DATA is a CompressComplex virtual column that
+       stores each real and imaginary part as a 16-bit integer, scaled and
+       offset per row so the cell's full range is covered. Readers see an
+       ordinary Complex DATA column; the error in each part is at most half
+       a step, i.e. (max - min) / 131068 of the values in that row's cell. */
+
+    String datastore = MS::columnName (MS::DATA);
+    CompressComplex compressor ("DATA", "DATA_COMPRESSED", "DATA_SCALE", "DATA_OFFSET", True);
+
+    if (opts.compress) {
+	datastore = "DATA_COMPRESSED";
+	td.addColumn (ArrayColumnDesc<Int> (datastore, "DATA as scaled 16-bit integers", 2));
+	td.addColumn (ScalarColumnDesc<Float> ("DATA_SCALE", "DATA_COMPRESSED scale factor"));
+	td.addColumn (ScalarColumnDesc<Float> ("DATA_OFFSET", "DATA_COMPRESSED offset"));
+    }
+
+    td.defineHypercolumn ("TiledData", 3, stringToVector (datastore));
     td.defineHypercolumn ("TiledFlag", 3, stringToVector (MS::columnName (MS::FLAG)));
     td.defineHypercolumn ("TiledUVW", 2, stringToVector (MS::columnName (MS::UVW)));
 
+    if (opts.layout == LAYOUT_READ_OPTIMIZED) {
+	td.defineHypercolumn ("TiledWeight", 2, stringToVector (MS::columnName (MS::WEIGHT)));
+	td.defineHypercolumn ("TiledSigma", 2, stringToVector (MS::columnName (MS::SIGMA)));
+    }
+
     SetupNewTable newtab (ms_path, td, Table::New);
     IncrementalStMan incrStMan ("ISMData");
     newtab.bindAll (incrStMan, True);
 
-    Int tileSize = nchan_p / 10 + 1;
+    /* ISM only stores a value when it changes, which is ideal for the
+       likes of ARRAY_ID and FIELD_ID but costs a new interval on nearly
+       every row for the columns below. Outside the legacy layout they go
+       into an SSM, whose bucket size trades write granularity against the
+       number of reads it takes to scan a column. */
+
+    const char *perrow[] = { "ANTENNA1", "ANTENNA2", "DATA_DESC_ID", "TIME",
+			     "TIME_CENTROID", "FLAG_ROW", "WEIGHT",
+			     "DATA_SCALE", "DATA_OFFSET", 0 };
+    Int bucketsize = (opts.layout == LAYOUT_READ_OPTIMIZED) ? 262144 : 32768;
+    StandardStMan rowStMan ("SSMRows", bucketsize);
+    TiledShapeStMan tiledStManW ("TiledWeight", IPosition (2, npol_p, 16384));
+    TiledShapeStMan tiledStManS ("TiledSigma", IPosition (2, npol_p, 16384));
+
+    if (opts.layout != LAYOUT_ISM_LEGACY) {
+	for (Int i = 0; perrow[i]; i++)
+	    if (td.isColumn (perrow[i]))
+		newtab.bindColumn (perrow[i], rowStMan);
+    }
+
+    if (opts.layout == LAYOUT_READ_OPTIMIZED) {
+	newtab.bindColumn (MS::columnName (MS::WEIGHT), tiledStManW);
+	newtab.bindColumn (MS::columnName (MS::SIGMA), tiledStManS);
+    }
+
+    // The DATA and FLAG cells hold one IF each.
+    WINDOW outwin = outputWindow ();
+    Int maxchan = (win.nspect > 0) ? 0 : nchan_p;
+    for (Int i = 0; i < win.nspect; i++)
+	maxchan = max (maxchan, outwin.nschan[i]);
+
+    Int nspect = max (win.nspect, 1);
+    TilePlan plan = plan_tiles (npol_p, maxchan, nspect,
+				nants_p * (nants_p + 1) / 2 * nspect, opts);
 
-    TiledShapeStMan tiledStMan1 ("TiledData",IPosition (3, npol_p, tileSize,
-							16384 / npol_p / tileSize));
-    TiledShapeStMan tiledStMan1f ("TiledFlag", IPosition (3, npol_p, tileSize,
-							  16384 / npol_p / tileSize));
-    TiledColumnStMan tiledStMan3 ("TiledUVW", IPosition (2, 3, 1024));
+    TiledShapeStMan tiledStMan1 ("TiledData", plan.data);
+    TiledShapeStMan tiledStMan1f ("TiledFlag", plan.flag);
+    TiledColumnStMan tiledStMan3 ("TiledUVW", plan.uvw);
 
-    newtab.bindColumn (MS::columnName (MS::DATA), tiledStMan1);
+    newtab.bindColumn (datastore, tiledStMan1);
+    if (opts.compress)
+	newtab.bindColumn (MS::columnName (MS::DATA), compressor);
     newtab.bindColumn (MS::columnName (MS::FLAG), tiledStMan1f);
     newtab.bindColumn (MS::columnName (MS::UVW), tiledStMan3);
 
-    TableLock lock (TableLock::PermanentLocking);
-    MeasurementSet ms (newtab, lock);
-    Table::TableOption option = Table::New;
+    TableLock lock (TableLock::PermanentLocking);
+    TSMOption tsmopt = opts.mmap ? TSMOption (TSMOption::MMap) : TSMOption ();
+    Table tab (newtab, lock, 0, False, Table::AipsrcEndian, tsmopt);
+    MeasurementSet ms (tab);
+    Table::TableOption option = Table::New;
+
+    if (!opts.mmap) {
+	ROTiledStManAccessor (ms, "TiledData").setMaximumCacheSize ((uInt) plan.cachebytes);
+	ROTiledStManAccessor (ms, "TiledFlag").setMaximumCacheSize ((uInt) (plan.cachebytes / 8));
+    }
+
+    // Record what we chose, for the benefit of anyone tuning this later.
+    TableRecord tiling;
+    tiling.define ("DATA_TILE", plan.data.asVector ());
+    tiling.define ("FLAG_TILE", plan.flag.asVector ());
+    tiling.define ("UVW_TILE", plan.uvw.asVector ());
+    tiling.define ("TILE_BYTES", opts.tilebytes);
+    tiling.define ("CACHE_BYTES", (Int64) plan.cachebytes);
+    tiling.define ("MMAP", opts.mmap);
+    tiling.define ("COMPRESS", opts.compress ? "lossy" : "none");
+    tiling.define ("LAYOUT", (opts.layout == LAYOUT_ISM_LEGACY) ? "ism-legacy" :
+		   (opts.layout == LAYOUT_BALANCED) ? "balanced" : "read-optimized");
+    ms.rwKeywordSet ().defineRecord ("MIRTOMS_TILING", tiling);
+    compress_p = opts.compress;
+
+    ScalarColumnDesc<Int> mirrecdesc (MIR_REC_COL, "Originating MIRIAD record number");
+
+    if (opts.layout == LAYOUT_ISM_LEGACY)
+	ms.addColumn (mirrecdesc);
+    else
+	ms.addColumn (mirrecdesc, "SSMRows", True);
+
+    if (averaging ()) {
+	ScalarColumnDesc<Int> lastrecdesc (MIR_LASTREC_COL, "Last MIRIAD record averaged into the row");
+
+	if (opts.layout == LAYOUT_ISM_LEGACY)
+	    ms.addColumn (lastrecdesc);
+	else
+	    ms.addColumn (lastrecdesc, "SSMRows", True);
+
+	TableRecord& kw = ScalarColumn<Int> (ms, MIR_LASTREC_COL).rwKeywordSet ();
+	kw.define ("CHANAVG", chanavg_p);
+	kw.define ("TIMEAVG", timeavg_p);
+    }
+
+    ms.createDefaultSubtables (option);
+
+    ms.spectralWindow ().addColumn (ArrayColumnDesc<Int>(
+					MSSpectralWindow::columnName(MSSpectralWindow::ASSOC_SPW_ID),
+					MSSpectralWindow::columnStandardComment(MSSpectralWindow::ASSOC_SPW_ID)));
+
+    ms.spectralWindow ().addColumn (ArrayColumnDesc<String>(
+					MSSpectralWindow::columnName(MSSpectralWindow::ASSOC_NATURE),
+					MSSpectralWindow::columnStandardComment(MSSpectralWindow::ASSOC_NATURE)));
+
+    ms.spectralWindow ().addColumn (ScalarColumnDesc<Int>(
+					MSSpectralWindow::columnName(MSSpectralWindow::DOPPLER_ID),
+					MSSpectralWindow::columnStandardComment(MSSpectralWindow::DOPPLER_ID)));
+
+    // the SOURCE table; 1 extra optional column needed
+    TableDesc sourceDesc = MSSource::requiredTableDesc ();
+    MSSource::addColumnToDesc (sourceDesc, MSSourceEnums::REST_FREQUENCY, 1);
+    SetupNewTable sourceSetup (ms.sourceTableName (), sourceDesc, option);
+    ms.rwKeywordSet ().defineTable (MS::keywordName(MS::SOURCE), Table (sourceSetup));
+
+    // the DOPPLER table; no optional columns needed
+    TableDesc dopplerDesc = MSDoppler::requiredTableDesc ();
+    SetupNewTable dopplerSetup (ms.dopplerTableName (),dopplerDesc, option);
+    ms.rwKeywordSet ().defineTable (MS::keywordName(MS::DOPPLER), Table (dopplerSetup));
+
+    // the SYSCAL table; 1 optional column needed
+    TableDesc syscalDesc = MSSysCal::requiredTableDesc ();
+    MSSysCal::addColumnToDesc (syscalDesc, MSSysCalEnums::TSYS, 1);
+    SetupNewTable syscalSetup (ms.sysCalTableName (), syscalDesc, option);
+    ms.rwKeywordSet ().defineTable (MS::keywordName (MS::SYSCAL), Table (syscalSetup));
+
+    ms.initRefs (); // "update the references to the subtable keywords"
+
+    {
+	// Set the TableInfo. I'm assuming that the braces are to trigger a destructor.
+	TableInfo& info (ms.tableInfo ());
+	info.setType (TableInfo::type (TableInfo::MEASUREMENTSET));
+	info.setSubType (String ("MIRIAD"));
+	info.readmeAddLine ("made with mirtoms");
+    }
+
+    ms_p = ms;
+    msc_p = new MSColumns (ms_p);
+}
+
+
+// Add MIRIAD_INPUT if need be, and note the path of every input in it.
+
+void
+Converter::addInputColumn (MeasurementSet& ms, Bool legacy)
+{
+    if (!ms.tableDesc ().isColumn (MIR_INPUT_COL)) {
+	ScalarColumnDesc<Int> inputdesc (MIR_INPUT_COL, "Index of the originating MIRIAD dataset");
+
+	if (legacy)
+	    ms.addColumn (inputdesc);
+	else
+	    ms.addColumn (inputdesc, "SSMRows", True);
+
+	// Any rows already there came from the MS's one earlier input.
+	ScalarColumn<Int> (ms, MIR_INPUT_COL).fillColumn (0);
+    }
+
+    // Absolute, so that mirmsflagextract can recognize its vis=.
+    Vector<String> paths (oldinputs_p.size () + 1);
+    for (size_t i = 0; i < oldinputs_p.size (); i++)
+	paths(i) = oldinputs_p[i];
+    paths(oldinputs_p.size ()) = Path (infile_p).absoluteName ();
+
+    ScalarColumn<Int> (ms, MIR_INPUT_COL).rwKeywordSet ().define ("INPUTS", paths);
+}
+
+
+/* Checkpoints. Every so many records we make sure that everything decoded
+   so far is in the MS, then note in a keyword where to pick up from and
+   how the fill options were set. The rest of our state -- fields,
+   sources, arrays, scan numbers -- follows from the MIRIAD metadata, so on
+   resuming we replay it by skipping through the records already
+   converted, just as a shard does, and then check that it came out the
+   same as what the checkpoint recorded. */
+
+static void
+remove_rows (Table t, uInt first)
+{
+    if (t.nrow () <= first)
+	return;
+
+    if (!t.canRemoveRow ())
+	throw AipsError ("cannot remove rows from table " + t.tableName ());
+
+    Vector<uInt> rows (t.nrow () - first);
+    indgen (rows, first);
+    t.removeRow (rows);
+}
+
+
+void
+Converter::writeCheckpoint (const FillOptions& opts, Int nextrec, uInt nrow, Int iscan,
+			    Int ifield_old, const std::vector<Int>& omitted)
+{
+    TableRecord cp;
+    cp.define ("NEXTREC", nextrec);
+    cp.define ("NROW", (Int64) nrow);
+    cp.define ("SCAN", iscan);
+    cp.define ("FIELD", ifield_old);
+    cp.define ("NFIELD", (Int) fields_p.size ());
+    cp.define ("NPOINT", npoint);
+    cp.define ("NARRAYS", num_arrays);
+    cp.define ("SNUMBASE", opts.snumbase);
+    cp.define ("FLAGCAT", opts.flagcat);
+    cp.define ("SPARSE", opts.sparse);
+    cp.define ("CHECKPOINT", opts.checkpoint);
+    cp.define ("DONE", False);
+    ms_p.rwKeywordSet ().defineRecord (CHECKPOINT_KW, cp);
+
+    if (opts.sparse)
+	ScalarColumn<Int> (ms_p, MIR_REC_COL).rwKeywordSet ().define (MIR_OMIT_KW,
+								      Vector<Int> (omitted));
+
+    ms_p.flush ();
+}
+
+
+/* Open an MS that we made for writing more to it, with the storage
+   options recorded in its MIRTOMS_TILING keyword: mmap= has to be given
+   when the table is opened, and the cache sizes don't persist. We look at
+   the keyword through a table that's closed again before the real open,
+   since casacore would otherwise hand us back the same object, opened
+   without the option. */
+
+static MeasurementSet
+open_for_update (const String& ms_path)
+{
+    Bool mmap;
+    Int64 cachebytes;
+
+    {
+	Table t (ms_path);
+
+	if (!t.keywordSet ().isDefined ("MIRTOMS_TILING"))
+	    throw AipsError ("MS " + ms_path + " was not made by mirtoms");
+
+	const TableRecord& tiling = t.keywordSet ().asRecord ("MIRTOMS_TILING");
+	mmap = tiling.asBool ("MMAP");
+	cachebytes = tiling.asInt64 ("CACHE_BYTES");
+    }
+
+    TableLock lock (TableLock::PermanentLocking);
+    TSMOption tsmopt = mmap ? TSMOption (TSMOption::MMap) : TSMOption ();
+    MeasurementSet ms (Table (ms_path, lock, Table::Update, tsmopt));
+
+    if (!mmap) {
+	uInt64 nbytes = min ((uInt64) cachebytes, MAX_CACHE_BYTES);
+
+	ROTiledStManAccessor (ms, "TiledData").setMaximumCacheSize ((uInt) nbytes);
+	ROTiledStManAccessor (ms, "TiledFlag").setMaximumCacheSize ((uInt) (nbytes / 8));
+    }
+
+    return ms;
+}
+
+
+void
+Converter::reopenMeasurementSet (const String& ms_path, FillOptions& opts)
+{
+    MeasurementSet ms (open_for_update (ms_path));
+
+    if (!ms.keywordSet ().isDefined (CHECKPOINT_KW))
+	throw AipsError ("MS " + ms_path + " has no checkpoint to resume from");
+
+    checkpoint_p = ms.keywordSet ().asRecord (CHECKPOINT_KW);
+
+    if (checkpoint_p.asBool ("DONE"))
+	throw AipsError ("MS " + ms_path + " has already been completely converted");
+
+    // The options that shape the main table have to match the first run.
+    opts.snumbase = checkpoint_p.asInt ("SNUMBASE");
+    opts.flagcat = checkpoint_p.asBool ("FLAGCAT");
+    opts.sparse = checkpoint_p.asBool ("SPARSE");
+    opts.checkpoint = checkpoint_p.asInt ("CHECKPOINT");
+    opts.recbegin = checkpoint_p.asInt ("NEXTREC");
+    opts.startrow = checkpoint_p.asInt64 ("NROW");
+
+    const TableRecord& tiling = ms.keywordSet ().asRecord ("MIRTOMS_TILING");
+    compress_p = (tiling.asString ("COMPRESS") == "lossy");
+
+    // We refill the subtables from scratch; the main table's rows after
+    // the checkpoint are overwritten as we go.
+    remove_rows (ms.observation (), 0);
+    remove_rows (ms.history (), 0);
+    remove_rows (ms.antenna (), 0);
+    remove_rows (ms.sysCal (), 0);
+    remove_rows (ms.spectralWindow (), 0);
+    remove_rows (ms.dataDescription (), 0);
+    remove_rows (ms.polarization (), 0);
+    remove_rows (ms.doppler (), 0);
+    remove_rows (ms.field (), 0);
+    remove_rows (ms.source (), 0);
+    remove_rows (ms.feed (), 0);
+
+    ms_p = ms;
+    msc_p = new MSColumns (ms_p);
+}
+
+
+void
+Converter::checkResumeState (Int iscan, Int ifield_old)
+{
+    if (iscan != checkpoint_p.asInt ("SCAN") ||
+	ifield_old != checkpoint_p.asInt ("FIELD") ||
+	(Int) fields_p.size () != checkpoint_p.asInt ("NFIELD") ||
+	npoint != checkpoint_p.asInt ("NPOINT") ||
+	num_arrays != checkpoint_p.asInt ("NARRAYS"))
+	throw AipsError ("replaying " + infile_p + " up to record " +
+			 String::toString (checkpoint_p.asInt ("NEXTREC")) +
+			 " did not reproduce the checkpointed state; has it changed?");
+}
+
+
+void
+Converter::markComplete ()
+{
+    TableRecord cp = ms_p.keywordSet ().asRecord (CHECKPOINT_KW);
+    cp.define ("DONE", True);
+    ms_p.rwKeywordSet ().defineRecord (CHECKPOINT_KW, cp);
+    ms_p.flush ();
+}
+
+
+/* Appending. At the end of every conversion we note in a keyword what
+   decides the subtables' contents -- the arrays, spectral setups,
+   sources, and fields, the next scan number, and the inputs so far -- so
+   that a later run with append=true can pick up where it left off: data
+   from known antennas, setups, and pointings get the existing IDs, and
+   only what's new is added to the subtables. Main table rows go after the
+   existing ones, through the storage managers already bound to the
+   columns. Nothing already written is changed, apart from MIRIAD_INPUT
+   being filled in as 0 when the MS had had only one input. */
+
+void
+Converter::saveState ()
+{
+    TableRecord state, arrays, spws, sources, fields;
+
+    Vector<String> telescope (arrays_p.size ());
+    Vector<Int> nants (arrays_p.size ()), antbase (arrays_p.size ()), nant (arrays_p.size ());
+    std::vector<Double> antpos;
+
+    for (size_t i = 0; i < arrays_p.size (); i++) {
+	telescope(i) = arrays_p[i].telescope;
+	nants(i) = arrays_p[i].nants;
+	antbase(i) = arrays_p[i].antbase;
+	nant(i) = nAnt_p[i];
+	antpos.insert (antpos.end (), arrays_p[i].antpos.begin (), arrays_p[i].antpos.end ());
+    }
+
+    arrays.define ("TELESCOPE", telescope);
+    arrays.define ("NANTS", nants);
+    arrays.define ("ANTBASE", antbase);
+    arrays.define ("NANT_SEEN", nant);
+    arrays.define ("ANTPOS", Vector<Double> (antpos));
+
+    // Every setup has the same number of windows; see appendMeasurementSet.
+    Int nset = spwsets_p.size ();
+    Int nspect = nset ? spwsets_p[0].win.nspect : 0;
+    Vector<Int> nschan (nset * nspect), ischan (nset * nspect);
+    Vector<Double> sfreq (nset * nspect), sdf (nset * nspect), restfreq (nset * nspect);
+    Vector<String> code (nset);
+
+    for (Int s = 0; s < nset; s++) {
+	const WINDOW& w = spwsets_p[s].win;
+
+	for (Int i = 0; i < nspect; i++) {
+	    nschan(s * nspect + i) = w.nschan[i];
+	    ischan(s * nspect + i) = w.ischan[i];
+	    sfreq(s * nspect + i) = w.sfreq[i];
+	    sdf(s * nspect + i) = w.sdf[i];
+	    restfreq(s * nspect + i) = w.restfreq[i];
+	}
+
+	code(s) = String (w.code, nspect);
+    }
+
+    spws.define ("NSPECT", nspect);
+    spws.define ("NSCHAN", nschan);
+    spws.define ("ISCHAN", ischan);
+    spws.define ("SFREQ", sfreq);
+    spws.define ("SDF", sdf);
+    spws.define ("RESTFREQ", restfreq);
+    spws.define ("CODE", code);
+
+    Vector<String> name (sources_p.size ()), purpose (sources_p.size ());
+    Vector<Double> ra (sources_p.size ()), dec (sources_p.size ());
+
+    for (size_t i = 0; i < sources_p.size (); i++) {
+	name(i) = sources_p[i].name;
+	purpose(i) = sources_p[i].purpose;
+	ra(i) = sources_p[i].ra;
+	dec(i) = sources_p[i].dec;
+    }
+
+    sources.define ("NAME", name);
+    sources.define ("PURPOSE", purpose);
+    sources.define ("RA", ra);
+    sources.define ("DEC", dec);
+
+    Vector<Int> source (fields_p.size ());
+    Vector<Float> dra (fields_p.size ()), ddec (fields_p.size ());
+
+    ra.resize (fields_p.size ());
+    dec.resize (fields_p.size ());
+
+    for (size_t i = 0; i < fields_p.size (); i++) {
+	source(i) = fields_p[i].key.source;
+	dra(i) = fields_p[i].key.dra;
+	ddec(i) = fields_p[i].key.ddec;
+	ra(i) = fields_p[i].ra;
+	dec(i) = fields_p[i].dec;
+    }
+
+    fields.define ("SOURCE", source);
+    fields.define ("DRA", dra);
+    fields.define ("DDEC", ddec);
+    fields.define ("RA", ra);
+    fields.define ("DEC", dec);
+
+    Vector<String> paths (oldinputs_p.size () + 1);
+    for (size_t i = 0; i < oldinputs_p.size (); i++)
+	paths(i) = oldinputs_p[i];
+    paths(oldinputs_p.size ()) = Path (infile_p).absoluteName ();
+
+    state.define ("INPUTS", paths);
+    state.define ("NEXTSCAN", nextscan_p);
+    state.define ("NPOINT", npoint);
+    state.define ("EPOCH", epoch_p);
+    state.defineRecord ("ARRAYS", arrays);
+    state.defineRecord ("SPECTRAL_SETUPS", spws);
+    state.defineRecord ("SOURCES", sources);
+    state.defineRecord ("FIELDS", fields);
+    ms_p.rwKeywordSet ().defineRecord (STATE_KW, state);
+    ms_p.flush ();
+}
+
+
+void
+Converter::loadState (const TableRecord& state)
+{
+    Vector<String> paths (state.asArrayString ("INPUTS"));
+    oldinputs_p = paths.tovector ();
+    nextscan_p = state.asInt ("NEXTSCAN");
+    npoint = state.asInt ("NPOINT");
+
+    const TableRecord& arrays = state.asRecord ("ARRAYS");
+    Vector<String> telescope (arrays.asArrayString ("TELESCOPE"));
+    Vector<Int> nants (arrays.asArrayInt ("NANTS")), antbase (arrays.asArrayInt ("ANTBASE"));
+    Vector<Int> nant (arrays.asArrayInt ("NANT_SEEN"));
+    Vector<Double> antpos (arrays.asArrayDouble ("ANTPOS"));
+    const Double *pos = antpos.data ();
+
+    for (uInt i = 0; i < telescope.nelements (); i++) {
+	ArrayInfo info;
+	info.telescope = telescope(i);
+	info.nants = nants(i);
+	info.antbase = antbase(i);
+	info.antpos.assign (pos, pos + 3 * nants(i));
+	pos += 3 * nants(i);
+	arrays_p.push_back (info);
+    }
+
+    num_arrays = arrays_p.size ();
+    nAnt_p.resize (num_arrays);
+    nantold_p = nant.tovector ();
+    for (Int i = 0; i < num_arrays; i++)
+	nAnt_p[i] = nant(i);
+
+    const TableRecord& spws = state.asRecord ("SPECTRAL_SETUPS");
+    Int nspect = spws.asInt ("NSPECT");
+    Vector<Int> nschan (spws.asArrayInt ("NSCHAN")), ischan (spws.asArrayInt ("ISCHAN"));
+    Vector<Double> sfreq (spws.asArrayDouble ("SFREQ")), sdf (spws.asArrayDouble ("SDF"));
+    Vector<Double> restfreq (spws.asArrayDouble ("RESTFREQ"));
+    Vector<String> code (spws.asArrayString ("CODE"));
+
+    for (uInt s = 0; s < code.nelements (); s++) {
+	SpwSet set;
+	memset (&set.win, 0, sizeof (set.win));
+	set.win.nspect = nspect;
+
+	for (Int i = 0; i < nspect; i++) {
+	    set.win.nschan[i] = nschan(s * nspect + i);
+	    set.win.ischan[i] = ischan(s * nspect + i);
+	    set.win.sfreq[i] = sfreq(s * nspect + i);
+	    set.win.sdf[i] = sdf(s * nspect + i);
+	    set.win.restfreq[i] = restfreq(s * nspect + i);
+	    set.win.code[i] = code(s)[i];
+	}
+
+	// Its rows are already written.
+	set.time = set.ra = set.dec = 0;
+	set.done = True;
+	spwsets_p.push_back (set);
+    }
+
+    nspwold_p = spwsets_p.size ();
+
+    const TableRecord& sources = state.asRecord ("SOURCES");
+    Vector<String> name (sources.asArrayString ("NAME")), purpose (sources.asArrayString ("PURPOSE"));
+    Vector<Double> ra (sources.asArrayDouble ("RA")), dec (sources.asArrayDouble ("DEC"));
+
+    for (uInt i = 0; i < name.nelements (); i++) {
+	SourceInfo src;
+	src.name = name(i);
+	src.purpose = purpose(i);
+	src.ra = ra(i);
+	src.dec = dec(i);
+	sources_p.push_back (src);
+	sourceindex_p[src.name] = i;
+    }
+
+    const TableRecord& fields = state.asRecord ("FIELDS");
+    Vector<Int> source (fields.asArrayInt ("SOURCE"));
+    Vector<Float> dra (fields.asArrayFloat ("DRA")), ddec (fields.asArrayFloat ("DDEC"));
+
+    ra = fields.asArrayDouble ("RA");
+    dec = fields.asArrayDouble ("DEC");
+
+    for (uInt i = 0; i < source.nelements (); i++) {
+	FieldInfo fi;
+	fi.key.source = source(i);
+	fi.key.dra = dra(i);
+	fi.key.ddec = ddec(i);
+	fi.ra = ra(i);
+	fi.dec = dec(i);
+	fields_p.push_back (fi);
+	fieldindex_p[fi.key] = i;
+    }
+}
+
+
+void
+Converter::appendMeasurementSet (const String& ms_path, FillOptions& opts)
+{
+    MeasurementSet ms (open_for_update (ms_path));
+
+    if (!ms.keywordSet ().isDefined (STATE_KW))
+	throw AipsError ("MS " + ms_path + " was not made by a mirtoms that can append to it");
+
+    if (ms.keywordSet ().isDefined (CHECKPOINT_KW) &&
+	!ms.keywordSet ().asRecord (CHECKPOINT_KW).asBool ("DONE"))
+	throw AipsError ("MS " + ms_path + " has an unfinished conversion; resume it first");
+
+    if (ScalarColumn<Int> (ms, MIR_REC_COL).keywordSet ().isDefined (MIR_OMIT_KW))
+	throw AipsError ("cannot append to MS " + ms_path + ", which was made with sparse=true");
+
+    if (!ms.canAddRow ())
+	throw AipsError ("cannot add rows to MS " + ms_path + "; is it a multi-MS?");
+
+    Bool averaged = ms.tableDesc ().isColumn (MIR_LASTREC_COL);
+
+    if (averaged != averaging ())
+	throw AipsError ("the averaging (chanavg=, timeavg=) must match that of MS " + ms_path);
+
+    if (averaged) {
+	const TableRecord& kw = ScalarColumn<Int> (ms, MIR_LASTREC_COL).keywordSet ();
+
+	if (kw.asInt ("CHANAVG") != chanavg_p || kw.asDouble ("TIMEAVG") != timeavg_p)
+	    throw AipsError ("the averaging (chanavg=, timeavg=) must match that of MS " + ms_path);
+    }
+
+    const TableRecord& state = ms.keywordSet ().asRecord (STATE_KW);
+
+    if (!nearAbs (state.asDouble ("EPOCH"), epoch_p, 0.01))
+	throw AipsError ("input " + infile_p + " has a different epoch than MS " + ms_path);
 
-    ms.addColumn (ScalarColumnDesc<Int> (MIR_REC_COL, "Originating MIRIAD record number"));
+    loadState (state);
 
-    ms.createDefaultSubtables (option);
+    // The data have to fit the cells and polarization setup already there.
+    if (!spwsets_p.empty ()) {
+	const WINDOW& first = spwsets_p[0].win;
+	Bool same = (win.nspect == first.nspect);
 
-    ms.spectralWindow ().addColumn (ArrayColumnDesc<Int>(
-					MSSpectralWindow::columnName(MSSpectralWindow::ASSOC_SPW_ID),
-					MSSpectralWindow::columnStandardComment(MSSpectralWindow::ASSOC_SPW_ID)));
+	for (Int i = 0; same && i < win.nspect; i++)
+	    same = (win.nschan[i] == first.nschan[i]);
 
-    ms.spectralWindow ().addColumn (ArrayColumnDesc<String>(
-					MSSpectralWindow::columnName(MSSpectralWindow::ASSOC_NATURE),
-					MSSpectralWindow::columnStandardComment(MSSpectralWindow::ASSOC_NATURE)));
+	if (!same)
+	    throw AipsError ("input " + infile_p + " has a different number of channels or "
+			     "spectral windows than MS " + ms_path);
+    }
 
-    ms.spectralWindow ().addColumn (ScalarColumnDesc<Int>(
-					MSSpectralWindow::columnName(MSSpectralWindow::DOPPLER_ID),
-					MSSpectralWindow::columnStandardComment(MSSpectralWindow::DOPPLER_ID)));
+    MSColumns msc (ms);
+    Vector<Int> corrtype (msc.polarization ().corrType ()(0));
 
-    // the SOURCE table; 1 extra optional column needed
-    TableDesc sourceDesc = MSSource::requiredTableDesc ();
-    MSSource::addColumnToDesc (sourceDesc, MSSourceEnums::REST_FREQUENCY, 1);
-    SetupNewTable sourceSetup (ms.sourceTableName (), sourceDesc, option);
-    ms.rwKeywordSet ().defineTable (MS::keywordName(MS::SOURCE), Table (sourceSetup));
+    if (corrtype.nelements () != corrType_p.nelements () || !allEQ (corrtype, corrType_p))
+	throw AipsError ("input " + infile_p + " has different polarizations than MS " + ms_path);
 
-    // the DOPPLER table; no optional columns needed
-    TableDesc dopplerDesc = MSDoppler::requiredTableDesc ();
-    SetupNewTable dopplerSetup (ms.dopplerTableName (),dopplerDesc, option);
-    ms.rwKeywordSet ().defineTable (MS::keywordName(MS::DOPPLER), Table (dopplerSetup));
+    const TableRecord& tiling = ms.keywordSet ().asRecord ("MIRTOMS_TILING");
+    compress_p = (tiling.asString ("COMPRESS") == "lossy");
 
-    // the SYSCAL table; 1 optional column needed
-    TableDesc syscalDesc = MSSysCal::requiredTableDesc ();
-    MSSysCal::addColumnToDesc (syscalDesc, MSSysCalEnums::TSYS, 1);
-    SetupNewTable syscalSetup (ms.sysCalTableName (), syscalDesc, option);
-    ms.rwKeywordSet ().defineTable (MS::keywordName (MS::SYSCAL), Table (syscalSetup));
+    addInputColumn (ms, tiling.asString ("LAYOUT") == "ism-legacy");
 
-    ms.initRefs (); // "update the references to the subtable keywords"
+    // For the LSRK frame of any new spectral setup.
+    msc.antenna ().position ().keywordSet ().get ("ARRAY_POSITION", arrayXYZ_p);
 
-    {
-	// Set the TableInfo. I'm assuming that the braces are to trigger a destructor.
-	TableInfo& info (ms.tableInfo ());
-	info.setType (TableInfo::type (TableInfo::MEASUREMENTSET));
-	info.setSubType (String ("MIRIAD"));
-	info.readmeAddLine ("made with mirtoms");
-    }
+    opts.startrow = ms.nrow ();
+    opts.snumbase = max (opts.snumbase, nextscan_p);
 
     ms_p = ms;
     msc_p = new MSColumns (ms_p);
@@ -411,16 +2679,18 @@ Converter::setupMeasurementSet (const String& ms_path)
 void
 Converter::fillObsTables ()
 {
+    // One OBSERVATION row per input; see convert_inputs.
+    Int obs = ms_p.observation ().nrow ();
     ms_p.observation ().addRow ();
     MSObservationColumns msObsCol (ms_p.observation ());
 
-    msObsCol.telescopeName ().put (0, telescope_name);
-    msObsCol.observer ().put (0, observer_name);
-    msObsCol.project ().put (0, project_name);
+    msObsCol.telescopeName ().put (obs, telescope_name);
+    msObsCol.observer ().put (obs, observer_name);
+    msObsCol.project ().put (obs, project_name);
 
     MSHistoryColumns msHisCol (ms_p.history ());
 
-    Int row = 0;
+    Int row = ms_p.history ().nrow ();
     char hline[8192]; // sigh, magic buffer sizes
 
     hisopen_c (uv_handle_p, "read");
@@ -433,7 +2703,7 @@ Converter::fillObsTables ()
 	    break;
 
 	ms_p.history ().addRow ();
-	msHisCol.observationId ().put (row, 0);
+	msHisCol.observationId ().put (row, obs);
 	msHisCol.priority ().put (row, "NORMAL");
 	msHisCol.origin ().put (row, "Converter::fillObsTables");
 	msHisCol.application ().put (row, "mirtoms");
@@ -447,225 +2717,368 @@ Converter::fillObsTables ()
 
 
 void
-Converter::fillMSMainTable (Int snumbase)
+Converter::fillMSMainTable (const FillOptions& opts)
 {
     MSColumns& msc (*msc_p);
-    ScalarColumn<Int> mirreccol (ms_p, MIR_REC_COL);
 
     Int nCorr = npol_p;
-    Int nChan = nchan_p;
-    Int nCat  = 3; // number of flagging categories
-    Int iscan = snumbase;
-    Int ifield_old;
-
-    Matrix<Complex> vis (nCorr, nChan);
-    Vector<Float>   sigma (nCorr);
-    Vector<String>  cat (nCat);
+    Int nCat  = opts.flagcat ? 3 : 0; // number of flagging categories
+    Int iscan = opts.snumbase;
+    Int ifield_old = -1;
+
+    Vector<String>  cat (3);
     cat(0) = "FLAG_CMD";
     cat(1) = "ORIGINAL";
     cat(2) = "USER";
     msc.flagCategory ().rwKeywordSet ().define ("CATEGORY", cat);
-    Cube<Bool> flagCat (nCorr, nChan, nCat, False);
-    Matrix<Bool> flag = flagCat.xyPlane (0); // references flagCat's storage
-    Vector<Float> w1 (nCorr), w2 (nCorr);
 
-    uvrewind_c (uv_handle_p); // may not be necessary anymore? Can't hurt ...
+    // By default, batch up one integration's worth of rows -- every
+    // baseline, autocorrelations included, times every IF -- as long as
+    // that doesn't take more than about 32 MB of cells per batch.
+    WINDOW outwin = outputWindow ();
+    Int nspect = max (win.nspect, 1);
+    Int ngroups;
+
+    if (opts.batchrows > 0)
+	ngroups = max (opts.batchrows / nspect, 1);
+    else {
+	size_t groupsize = 1;
+
+	for (Int i = 0; i < win.nspect; i++)
+	    groupsize += nCorr * outwin.nschan[i] * (sizeof (Complex) + (1 + nCat) * sizeof (Bool));
+
+	ngroups = nants_p * (nants_p + 1) / 2;
+	ngroups = max (min (ngroups, (Int) ((32 << 20) / groupsize)), 1);
+    }
+
+    BatchRing ring (ms_p, msc, nCorr, nCat, outwin, ngroups, opts.nthreads, opts.startrow,
+		    stats_p);
+    RowBatch *batch = ring.first ();
+    Averager avg (nCorr, win, chanavg_p, timeavg_p,
+		  averaging () ? max (nants_p * (nants_p + 1) / 2, 1) : 0, opts.sparse);
+    GroupSorter sorter (nCorr, win, opts.sort ? opts.sortmem : 0, opts.sorttmp, stats_p);
+    size_t nadopted = 0;
 
-    nAnt_p.resize (1);
-    nAnt_p[0] = 0;
+    // The groups of any earlier inputs are merged in with ours.
+    for (size_t i = 0; i + 1 < opts.sortruns.size (); i += 2)
+	nadopted += sorter.adopt (opts.sortfd, opts.sortruns[i], opts.sortruns[i + 1]);
+
+    uvrewind_c (uv_handle_p); // may not be necessary anymore? Can't hurt ...
+    selectWindows ();
 
     receptorAngle_p.resize (1);
-    Int recnum, row = -1, polstartrecnum;
+    Int recnum;
     int polsleft = 0;
-    Double interval;
-    Bool lastRowFlag = False;
     int nread, nwread;
-    Int ant1, ant2;
-    Double time;
-    Vector<Double> uvw (3);
+    GroupHeader hdr;
+    Int g = 0;
+    Bool skipping = False;
+    std::vector<Int> omitted;
+    Int lastcheckpoint = opts.recbegin;
+    Int nconverted = 0;
+    MirPhase *readphase = mirstats_phase (stats_p, "uvread");
+    MirPhase *decodephase = mirstats_phase (stats_p, "decode");
+
+    /* If we know how many groups we'll write, add all of the rows now
+       rather than growing the table batch by batch. That's not possible
+       when sparse or averaged, since we don't know which groups will make
+       it, and pointless when our groups are only being passed on. Anything
+       left over is removed at the end. */
+
+    if (index_p && !opts.sparse && !averaging () && !opts.sortpass) {
+	const std::vector<int32_t>& groups = index_p->groups;
+	Int first = std::lower_bound (groups.begin (), groups.end (), opts.recbegin) - groups.begin ();
+	Int last = (opts.recend < 0) ? (Int) groups.size () :
+	    std::lower_bound (groups.begin (), groups.end (), opts.recend) - groups.begin ();
+	uInt nrow = opts.startrow + ((uInt) max (last - first, 0) + nadopted) * nspect;
+
+	if (nrow > ms_p.nrow ())
+	    ms_p.addRow (nrow - ms_p.nrow ());
+    }
+
+    if (opts.resume && opts.sparse) {
+	Vector<Int> before;
+	ScalarColumn<Int> (ms_p, MIR_REC_COL).keywordSet ().get (MIR_OMIT_KW, before);
+	omitted = before.tovector ();
+    } else if (opts.checkpoint > 0 && !opts.resume)
+	// So that even a run that dies early can be resumed.
+	writeCheckpoint (opts, 0, 0, iscan, ifield_old, omitted);
+
+#ifdef MIRTOMS_COUNT_ALLOCS
+    unsigned long allocs_before = alloc_count;
+#endif
 
     for (recnum = 0; ; recnum++) {
-	uvread_c (uv_handle_p, preamble, data, flags, MAXCHAN, &nread);
-	if (nread <= 0)
-	    break;
+	// Groups outside of the requested record range are skipped over
+	// without reading their data, but we still go through all of the
+	// metadata bookkeeping so that field IDs, scan numbers, and the
+	// subtables come out the same as in a full conversion.
 
-	if (win.nspect > 0)
-	    uvwread_c (uv_handle_p, wdata, wflags, MAXCHAN, &nwread);
-	else
-	    nwread = 0;
+	if (polsleft == 0) {
+	    skipping = (recnum < opts.recbegin ||
+			(opts.recend >= 0 && recnum >= opts.recend));
+
+	    if (opts.resume && recnum == opts.recbegin)
+		checkResumeState (iscan, ifield_old);
+	}
+
+	if (skipping) {
+	    if (!skip_record ())
+		break;
+	} else {
+	    {
+		MirTimer t (readphase, false);
+		uvread_c (uv_handle_p, preamble, data, flags, MAXCHAN, &nread);
+		refresh_vars ();
+
+		if (nread > 0 && win.nspect > 0)
+		    uvwread_c (uv_handle_p, wdata, wflags, MAXCHAN, &nwread);
+		else
+		    nwread = 0;
+	    }
+
+	    if (nread <= 0)
+		break;
 
-	if (nread != nchan_p)
-	    throw AipsError ("cannot handle nchan changing from " + String (nchan_p) +
-			     " to " + String (nread));
+	    nconverted++;
 
-	if (nwread != nwide_p)
-	    throw AipsError ("cannot handle nwide changing from " + String (nwide_p) +
-			     " to " + String (nwread));
+	    if (nread != nchan_p)
+		throw AipsError ("cannot handle nchan changing from " + String (nchan_p) +
+				 " to " + String (nread));
+
+	    if (nwread != nwide_p)
+		throw AipsError ("cannot handle nwide changing from " + String (nwide_p) +
+				 " to " + String (nwread));
+	}
 
 	if (polsleft == 0) {
 	    // starting a new simultaneous polarization record
-	    uvrdvr_c (uv_handle_p, H_INT, "npol", (char *) &polsleft, NULL, 1);
+	    polsleft = npolvar_p.value ();
 
 	    int baseline = (int) preamble[4];
 	    // XXX: we're not handling the MIRIAD >256-ant convention
-	    ant1 = baseline / 256;
-	    ant2 = baseline - ant1 * 256;
+	    hdr.ant1 = baseline / 256;
+	    hdr.ant2 = baseline - hdr.ant1 * 256;
 
 	    // get time in MJD seconds ; input was in JD
-	    time = (preamble[3] - 2400000.5) * C::day;
-	    time_p = time;
-	    interval = inttime_p;
+	    hdr.time = (preamble[3] - 2400000.5) * C::day;
+	    time_p = hdr.time;
+	    hdr.interval = inttime_p;
 
 	    if (uvupdate_c (uv_handle_p))
 		track_updates (); // something important changed.
 
 	    // CARMA stuff for different "arrays" in the MS
-	    nAnt_p[num_arrays-1] = max (nAnt_p[num_arrays-1], ant1);
-	    nAnt_p[num_arrays-1] = max (nAnt_p[num_arrays-1], ant2);
+	    nAnt_p[curarray_p] = max (nAnt_p[curarray_p], hdr.ant1);
+	    nAnt_p[curarray_p] = max (nAnt_p[curarray_p], hdr.ant2);
 
 	    // change antenna numbering convention from MIRIAD to CASA.
-	    ant1--;
-	    ant2--;
+	    hdr.ant1--;
+	    hdr.ant2--;
 
 	    // convert ns -> m and to CASA/AIPS sign convention
-	    uvw(0) = preamble[0];
-	    uvw(1) = preamble[1];
-	    uvw(2) = preamble[2];
-	    uvw *= -1e-9 * C::c;
-
-	    flag = 1; // clear all, in case current npol != nCorr
-	    vis = 0;
-	    polstartrecnum = recnum;
+	    for (Int i = 0; i < 3; i++)
+		hdr.uvw[i] = preamble[i] * -1e-9 * C::c;
+
+	    g = batch->nextGroup ();
+	    hdr.recnum = recnum;
+	    hdr.input = oldinputs_p.size ();
+	    hdr.spwbase = spwset_p * nspect;
+
+	    if (!skipping) {
+		if (averaging ())
+		    avg.clearInput ();
+		else if (opts.sort)
+		    sorter.clearInput ();
+		else
+		    batch->clearGroup (g);
+	    }
+	}
+
+	if (skipping) {
+	    polsleft--;
+
+	    if (polsleft == 0 && win.nspect > 0) {
+		if (ifield_old >= 0 && ifield_old != ifield)
+		    iscan++;
+		ifield_old = ifield;
+	    }
+
+	    continue;
 	}
 
 	int mirpol;
 	Int casapolidx;
-	uvrdvr_c (uv_handle_p, H_INT, "pol", (char *) &mirpol, NULL, 1);
+	mirpol = polvar_p.value ();
 	casapolidx = polmapping(mirpol + 8);
 
 	if (casapolidx < 0)
 	    throw AipsError ("unexpected MIRIAD polarization " + mirpol);
 
-	Int count = 0;
+	// Decode each IF's channels straight into its cell of the batch,
+	// or of the averager or sorter, conjugating and inverting the flags
+	// as we go; see mirkernels.h. IFs go to separate rows in the MS,
+	// pol's do not!
 
-	for (Int chan = 0; chan < nChan; chan++) {
-	    // MIRIAD uses ant1->ant2; FITS/AIPS/CASA use ant2->ant1
-	    // Along with negating UVW, we need to conjugate the visibility.
-	    Bool visFlag = (flags[count/2] == 0) ? False : True;
-	    Float visReal = +data[count]; count++;
-	    Float visImag = -data[count]; count++;
-	    Float wt = 1.0;
+	{
+	    MirTimer t (decodephase, false);
 
-	    if (!visFlag)
-		wt = -wt;
+	    for (Int ifno = 0; ifno < win.nspect; ifno++) {
+		Int woffset = win.ischan[ifno] - 1;
+		Complex *vis;
+		Bool *flag;
+
+		if (averaging ()) {
+		    vis = avg.visCell (ifno);
+		    flag = avg.flagCell (ifno);
+		} else if (opts.sort) {
+		    vis = sorter.visCell (ifno);
+		    flag = sorter.flagCell (ifno);
+		} else {
+		    vis = batch->visCell (ifno, g);
+		    flag = batch->flagCell (ifno, g);
+		}
 
-	    flag(casapolidx,chan) = (wt <= 0);
-	    vis(casapolidx,chan) = Complex (visReal, visImag);
+		decode_spectrum (data + 2 * woffset, flags + woffset, win.nschan[ifno],
+				 (float *) (vis + casapolidx), flag + casapolidx, nCorr);
+	    }
 	}
 
 	polsleft--;
 
-	if (polsleft == 0) {
+	if (polsleft == 0 && win.nspect > 0) {
 	    /* Done with this set of simultaneous pols. carmafiller won't
-	       write a row if it's all flagged, but we do that to maintain
-	       synchronization with MIRIAD records, which allows
-	       mirmsflagextract to have simple sanity-checking logic. If we
-	       really wanted to save the disk space, we could stash a list of
-	       "omitted MIRIAD recnums" somewhere in the MS that
-	       mirmsflagextract could walk through while reading the data.
+	       write a row if it's all flagged, but by default we do that to
+	       maintain synchronization with MIRIAD records, which allows
+	       mirmsflagextract to have simple sanity-checking logic. With
+	       sparse=true we instead stash the ranges of omitted MIRIAD
+	       recnums in a keyword that mirmsflagextract walks through
+	       while reading the data.
 	    */
 
-	    for (Int ifno = 0; ifno < win.nspect; ifno++) {
-		// IFs go to separate rows in the MS, pol's do not!
-		ms_p.addRow ();
-		row++;
-
-		if (row == 0) {
-		    // first fill in values for all the unused columns
-		    ifield_old = ifield;
-		    msc.feed1 ().put (row, 0);
-		    msc.feed2 ().put (row, 0);
-		    msc.flagRow ().put (row, False);
-		    lastRowFlag = False;
-		    msc.scanNumber ().put (row, iscan);
-		    msc.processorId ().put (row, -1);
-		    msc.observationId ().put (row, 0);
-		    msc.stateId ().put (row, -1);
-
-		    if (!apply_tsys) {
-			Vector<Float> tmp (nCorr);
-			tmp = 1.0;
-			msc.weight ().put (row, tmp);
-			msc.sigma ().put (row, tmp);
-		    }
-		}
-
-		msc.exposure ().put (row, interval);
-		msc.interval ().put (row, interval);
-
-		// XXX: we're re-copying all of the data!
-
-		Matrix<Complex> tvis (nCorr, win.nschan[ifno]);
-		Cube<Bool> tflagCat (nCorr, win.nschan[ifno], nCat, False);
-		Matrix<Bool> tflag = tflagCat.xyPlane (0); // references flagCat's storage
+	    if (ifield_old >= 0 && ifield_old != ifield)
+		iscan++;
 
-		Int woffset = win.ischan[ifno] - 1;
-		Int wsize = win.nschan[ifno];
-		for (int j = 0; j < nCorr; j++) {
-		    for (Int i = 0; i < wsize; i++) {
-			tvis(j,i) = vis(j,i+woffset);
-			tflag(j,i) = flag(j,i+woffset);
-		    }
-		}
+	    ifield_old = ifield;
+	    hdr.array = curarray_p;
+	    hdr.field = ifield;
+	    hdr.scan = iscan;
+	    hdr.lastrec = recnum;
+	    hdr.exposure = hdr.interval;
 
-		msc.data ().put(row, tvis);
-		msc.flag ().put(row, tflag);
-		msc.flagCategory ().put (row, tflagCat);
+	    Float weight = 1.0;
 
-		Bool rowFlag = allEQ (flag, True);
-		if (rowFlag != lastRowFlag) {
-		    msc.flagRow ().put (row, rowFlag);
-		    lastRowFlag = rowFlag;
-		}
+	    if (apply_tsys) {
+		if (systemp[hdr.ant1] == 0 || systemp[hdr.ant2] == 0)
+		    weight = 0.0;
+		else
+		    weight = 1.0 / sqrt ((double) (systemp[hdr.ant1] * systemp[hdr.ant2]));
+	    }
 
-		msc.antenna1 ().put (row, ant1);
-		msc.antenna2 ().put (row, ant2);
-		msc.time ().put (row, time); // note: CARMA timing convention changed in 2009
-		msc.timeCentroid ().put (row, time);
+	    for (Int j = 0; j < 4; j++)
+		hdr.weight[j] = weight;
 
-		if (apply_tsys) {
-		    w2 = 1.0; // "i use this as a 'version' id  to test FC refresh bugs :-)"
+	    // The dataset numbers its own antennas; in the MS they're
+	    // rows of its array's part of the ANTENNA table.
+	    hdr.ant1 += arrays_p[curarray_p].antbase;
+	    hdr.ant2 += arrays_p[curarray_p].antbase;
 
-		    if (systemp[ant1] == 0 || systemp[ant2] == 0)
-			w1 = 0.0;
-		    else
-			w1 = 1.0 / sqrt ((double) (systemp[ant1] * systemp[ant2]));
+	    if (averaging ()) {
+		avg.add (hdr, arrays_p[curarray_p].antbase, ring, batch);
+		continue;
+	    }
 
-		    msc.weight ().put (row, w1);
-		    msc.sigma ().put (row, w2);
-		}
+	    Bool flagged = opts.sort ? sorter.inputFlagged () : batch->groupFlagged (g);
 
-		msc.uvw ().put (row, uvw);
-		msc.arrayId ().put (row, num_arrays - 1);
-		msc.dataDescId ().put (row, ifno);
-		msc.fieldId ().put (row, ifield);
+	    if (opts.sparse && flagged)
+		add_omitted (omitted, hdr.recnum, recnum + 1);
+	    else if (opts.sort)
+		sorter.add (hdr);
+	    else {
+		batch->addGroup (hdr);
 
-		if (ifield_old != ifield)
-		    iscan++;
+		if (batch->full ())
+		    batch = ring.submit (batch);
+	    }
 
-		ifield_old = ifield;
-		msc.scanNumber ().put (row, iscan);
-		mirreccol.put (row, polstartrecnum);
+	    if (opts.checkpoint > 0 && recnum + 1 - lastcheckpoint >= opts.checkpoint) {
+		batch = ring.sync (batch);
+		writeCheckpoint (opts, recnum + 1, ring.nextRow (), iscan, ifield_old, omitted);
+		lastcheckpoint = recnum + 1;
 	    }
 	}
     }
 
+    if (averaging ())
+	avg.flush (ring, batch);
+    if (opts.sort && opts.sortpass)
+	sorter.passOn (opts.sortfd);
+    else if (opts.sort)
+	sorter.flush (ring, batch);
+
+    ring.finish (batch);
+    finishInput ();
+    nextscan_p = iscan + 1;
+
+    // A resumed run can end up shorter than the one that was interrupted
+    // if the latter had written past its last checkpoint, and the index
+    // may have overestimated.
+    remove_rows (ms_p, ring.nextRow ());
+
+    if (stats_p) {
+	stats_p->count ("records", nconverted);
+	stats_p->count ("visibilities", ring.dataValues ());
+	if (opts.sort) {
+	    stats_p->count ("sort_runs", sorter.nruns ());
+	    stats_p->count ("sort_merges", sorter.nmerges ());
+	}
+    }
+
+    // The rows are in order if we sorted all of them, including those of
+    // any earlier inputs, but appended rows are only in order among
+    // themselves. Groups passed on aren't in the MS yet.
+    if (!opts.sortpass) {
+	if (opts.sort && opts.startrow == 0)
+	    ms_p.rwKeywordSet ().define (SORT_KW, String ("time,baseline"));
+	else if (opts.append && ms_p.keywordSet ().isDefined (SORT_KW))
+	    ms_p.rwKeywordSet ().removeField (SORT_KW);
+    }
+
+    if (opts.sparse && !averaging ())
+	ScalarColumn<Int> (ms_p, MIR_REC_COL).rwKeywordSet ().define (MIR_OMIT_KW,
+								      Vector<Int> (omitted));
+
+    if (opts.checkpoint > 0)
+	writeCheckpoint (opts, recnum, ring.nextRow (), iscan, ifield_old, omitted);
+
+#ifdef MIRTOMS_COUNT_ALLOCS
+    cout << infile_p << ": " << alloc_count - allocs_before
+	 << " heap allocations while filling the main table" << endl;
+#endif
+
+    if (opts.quiet)
+	return;
+
     cout << infile_p << ": " << recnum << " visibilities, "
 	 << npoint << " pointings, "
-	 << nfield << " unique source/fields, "
-	 << source_p.nelements() << " sources, "
+	 << fields_p.size () << " unique source/fields, "
+	 << sources_p.size () << " sources, "
 	 << num_arrays << " arrays."
 	 << endl;
+
+    if (compress_p) {
+	// Four bytes per visibility plus a scale and offset per row.
+	Double nvis = ring.dataValues ();
+	Double rawbytes = nvis * sizeof (Complex);
+	Double packedbytes = nvis * sizeof (Int) + ms_p.nrow () * 2 * sizeof (Float);
+	Double secs = ring.dataSeconds ();
+
+	cout << infile_p << ": DATA compressed " << rawbytes / 1048576 << " MiB to "
+	     << packedbytes / 1048576 << " MiB (ratio "
+	     << (packedbytes > 0 ? rawbytes / packedbytes : 0.) << "), encoded at "
+	     << (secs > 0 ? rawbytes / 1048576 / secs : 0.) << " MiB/s"
+	     << endl;
+    }
 }
 
 
@@ -673,6 +3086,12 @@ void
 Converter::fillAntennaTable ()
 {
     // TODO: much of this should be tabulated, or preferably not hardcoded at all ...
+    ArrayInfo info;
+    info.telescope = telescope_name; // before any CARMA guesswork below
+    info.nants = nants_p;
+    info.antpos.assign (antpos, antpos + 3 * nants_p);
+    info.antbase = ms_p.antenna ().nrow ();
+
     arrayXYZ_p.resize (3);
 
     if (telescope_name == "HATCREEK" || telescope_name == "BIMA") {
@@ -775,6 +3194,8 @@ Converter::fillAntennaTable ()
     num_arrays++;
     nAnt_p.resize (num_arrays);
     nAnt_p[num_arrays - 1] = 0;
+    arrays_p.push_back (info);
+    curarray_p = num_arrays - 1;
 
     if (num_arrays > 1)
 	return;
@@ -791,22 +3212,27 @@ Converter::fillSyscalTable ()
 {
     MSSysCalColumns& msSys (msc_p->sysCal ());
     Vector<Float> tsys(1);
-    Int row = -1;
+    Int row = ms_p.sysCal ().nrow () - 1;
 
     // Note that we're using only one value for each receptor, since MIRIAD
     // has weak support for differing values (cf. xtsys and ytsys variables).
+    // We write the values from the end of each input.
 
-    for (Int i = 0; i < nants_p; i++) {
-	ms_p.sysCal ().addRow ();
-	row++;
+    for (size_t k = 0; k < syscal_p.size (); k++) {
+	const SyscalInfo& sc = syscal_p[k];
+
+	for (Int i = 0; i < (Int) sc.tsys.size (); i++) {
+	    ms_p.sysCal ().addRow ();
+	    row++;
 
-	msSys.antennaId ().put (row, i);
-	msSys.feedId ().put (row, 0);
-	msSys.spectralWindowId ().put (row, -1);
-	msSys.time ().put (row, time_p);
-	msSys.interval ().put (row, -1.0);
-	tsys(0) = systemp[i];
-	msSys.tsys ().put (row, tsys);
+	    msSys.antennaId ().put (row, sc.antbase + i);
+	    msSys.feedId ().put (row, 0);
+	    msSys.spectralWindowId ().put (row, -1);
+	    msSys.time ().put (row, sc.time);
+	    msSys.interval ().put (row, -1.0);
+	    tsys(0) = sc.tsys[i];
+	    msSys.tsys ().put (row, tsys);
+	}
     }
 }
 
@@ -820,87 +3246,103 @@ Converter::fillSpectralWindowTable ()
     MSDopplerColumns& msDop (msc_p->doppler ());
 
     MDirection::Types dirtype = epochRef_p;
-    MEpoch ep (Quantity (time_p, "s"), MEpoch::UTC);
     MPosition obspos (MVPosition (arrayXYZ_p), MPosition::ITRF);
-    MDirection dir (Quantity (ra_p, "rad"), Quantity (dec_p, "rad"), dirtype);
-    MeasFrame frame (ep, obspos, dir);
-
     MFrequency::Types freqsys_p = MFrequency::LSRK;
-    MFrequency::Convert tolsr (MFrequency::TOPO, MFrequency::Ref (freqsys_p, frame));
-
-    // We currently handle only one polarization setup.
-    ms_p.polarization ().addRow ();
-    msPol.numCorr ().put (0, npol_p);
-    msPol.corrType ().put (0, corrType_p);
-    msPol.corrProduct ().put (0, corrProduct_p);
-    msPol.flagRow ().put (0, False);
 
-    for (Int i = 0; i < win.nspect; i++) {
-	ms_p.doppler ().addRow ();
-	msDop.dopplerId ().put (i, i);
-	msDop.sourceId ().put (i, -1); // applies to all sources.
-	msDop.transitionId ().put (i, -1);
-	msDop.velDefMeas ().put (i, MDoppler (Quantity (0), MDoppler::RADIO));
+    // We currently handle only one polarization setup, which an MS we're
+    // appending to already has, along with the Doppler rows.
+    if (ms_p.polarization ().nrow () == 0) {
+	ms_p.polarization ().addRow ();
+	msPol.numCorr ().put (0, npol_p);
+	msPol.corrType ().put (0, corrType_p);
+	msPol.corrProduct ().put (0, corrProduct_p);
+	msPol.flagRow ().put (0, False);
+
+	for (Int i = 0; i < win.nspect; i++) {
+	    ms_p.doppler ().addRow ();
+	    msDop.dopplerId ().put (i, i);
+	    msDop.sourceId ().put (i, -1); // applies to all sources.
+	    msDop.transitionId ().put (i, -1);
+	    msDop.velDefMeas ().put (i, MDoppler (Quantity (0), MDoppler::RADIO));
+	}
     }
 
-    for (Int i = 0; i < win.nspect; i++) {
-	Int n = win.nschan[i];
-	Vector<Double> f(n), w(n);
+    // One block of rows per spectral setup; see selectWindows.
 
-	ms_p.spectralWindow ().addRow ();
-	ms_p.dataDescription ().addRow ();
+    for (size_t s = nspwold_p; s < spwsets_p.size (); s++) {
+	const SpwSet& set = spwsets_p[s];
+	const WINDOW& sw = set.win;
+	WINDOW outwin = outputWindow (sw);
 
-	msDD.spectralWindowId ().put (i, i);
-	msDD.polarizationId ().put (i, 0);
-	msDD.flagRow ().put (i, False);
+	MEpoch ep (Quantity (set.time, "s"), MEpoch::UTC);
+	MDirection dir (Quantity (set.ra, "rad"), Quantity (set.dec, "rad"), dirtype);
+	MeasFrame frame (ep, obspos, dir);
+	MFrequency::Convert tolsr (MFrequency::TOPO, MFrequency::Ref (freqsys_p, frame));
 
-	msSpW.numChan ().put (i, win.nschan[i]);
+	for (Int i = 0; i < sw.nspect; i++) {
+	    Int n = outwin.nschan[i];
+	    Int row = s * sw.nspect + i;
+	    Vector<Double> f(n), w(n);
 
-	Double BW = 0.0;
-	Double fwin = win.sfreq[i] * 1e9; // GHz -> Hz; a lot more of this on the way
-	fwin = tolsr (fwin).getValue ().getValue ();
+	    ms_p.spectralWindow ().addRow ();
+	    ms_p.dataDescription ().addRow ();
 
-	for (Int j = 0; j < win.nschan[i]; j++) {
-	    f(j) = fwin + j * win.sdf[i] * 1e9;
-	    w(j) = abs (win.sdf[i] * 1e9);
-	    BW += w(j);
-	}
+	    msDD.spectralWindowId ().put (row, row);
+	    msDD.polarizationId ().put (row, 0);
+	    msDD.flagRow ().put (row, False);
 
-	msSpW.chanFreq ().put (i, f);
-	if (i < win.nspect)
-	    msSpW.refFrequency ().put (i, win.restfreq[i] * 1e9);
-	else
-	    msSpW.refFrequency ().put (i, freq_p);
-
-	msSpW.resolution ().put (i, w);
-	msSpW.chanWidth ().put (i, w);
-	msSpW.effectiveBW ().put (i, w);
-	msSpW.totalBandwidth ().put (i, BW);
-	msSpW.ifConvChain ().put (i, 0);
-	msSpW.measFreqRef ().put (i, freqsys_p);
-	if (i < win.nspect)
-	    msSpW.dopplerId ().put (i, i); // CARMA has only 1 ref freq line
-	else
-	    msSpW.dopplerId ().put (i, -1); // no ref
+	    msSpW.numChan ().put (row, n);
 
-	if (win.sdf[i] > 0)
-	    msSpW.netSideband ().put (i, 1);
-	else if (win.sdf[i] < 0)
-	    msSpW.netSideband ().put (i, -1);
-	else
-	    msSpW.netSideband ().put (i, 0);
+	    Double BW = 0.0;
+	    Double fwin = sw.sfreq[i] * 1e9; // GHz -> Hz; a lot more of this on the way
+	    fwin = tolsr (fwin).getValue ().getValue ();
 
-	switch (win.code[i]) {
-	case 'N':
-	    msSpW.freqGroup ().put (i, 1);
-	    msSpW.freqGroupName ().put (i, "MULTI-CHANNEL-DATA");
-	    break;
-	case 'S':
-	    msSpW.freqGroup ().put (i, 2);
-	    msSpW.freqGroupName ().put (i, "MULTI-CHANNEL-AVG");
-	    break;
-	default:
-	    throw AipsError ("bad code for a spectral window");
+	    // An averaged channel is centered on the ones that went into it.
+	    for (Int j = 0; j < n; j++) {
+		Int first = j * chanavg_p;
+		Int nin = min (chanavg_p, sw.nschan[i] - first);
+
+		f(j) = fwin + (first + 0.5 * (nin - 1)) * sw.sdf[i] * 1e9;
+		w(j) = nin * abs (sw.sdf[i] * 1e9);
+		BW += w(j);
+	    }
+
+	    msSpW.chanFreq ().put (row, f);
+	    if (i < sw.nspect)
+		msSpW.refFrequency ().put (row, sw.restfreq[i] * 1e9);
+	    else
+		msSpW.refFrequency ().put (row, freq_p);
+
+	    msSpW.resolution ().put (row, w);
+	    msSpW.chanWidth ().put (row, w);
+	    msSpW.effectiveBW ().put (row, w);
+	    msSpW.totalBandwidth ().put (row, BW);
+	    msSpW.ifConvChain ().put (row, 0);
+	    msSpW.measFreqRef ().put (row, freqsys_p);
+	    if (i < sw.nspect)
+		msSpW.dopplerId ().put (row, i); // CARMA has only 1 ref freq line
+	    else
+		msSpW.dopplerId ().put (row, -1); // no ref
+
+	    if (sw.sdf[i] > 0)
+		msSpW.netSideband ().put (row, 1);
+	    else if (sw.sdf[i] < 0)
+		msSpW.netSideband ().put (row, -1);
+	    else
+		msSpW.netSideband ().put (row, 0);
+
+	    switch (sw.code[i]) {
+	    case 'N':
+		msSpW.freqGroup ().put (row, 1);
+		msSpW.freqGroupName ().put (row, "MULTI-CHANNEL-DATA");
+		break;
+	    case 'S':
+		msSpW.freqGroup ().put (row, 2);
+		msSpW.freqGroupName ().put (row, "MULTI-CHANNEL-AVG");
+		break;
+	    default:
+		throw AipsError ("bad code for a spectral window");
+	    }
 	}
     }
 }
@@ -909,7 +3351,10 @@ Converter::fillSpectralWindowTable ()
 void
 Converter::fillFieldTable ()
 {
-    msc_p->setDirectionRef (epochRef_p);
+    // That can only be done while the tables are empty; an MS we're
+    // appending to already has the same reference.
+    if (ms_p.field ().nrow () == 0)
+	msc_p->setDirectionRef (epochRef_p);
 
     MSFieldColumns& msField (msc_p->field ());
 
@@ -919,25 +3364,34 @@ Converter::fillFieldTable ()
 
     pm = 0; // We don't store proper motion.
 
-    if (nfield == 0) {
+    if (fields_p.empty ()) {
 	// if no pointings found, say there is 1
 	WARN ("no dra/ddec pointings found; creating one");
-	nfield = npoint = 1;
-	dra[0] = ddec[0] = 0.0;
+	FieldInfo fi;
+	fi.key.source = sourceIndex (object_p);
+	fi.key.dra = fi.key.ddec = 0.0;
+	fi.ra = ra_p;
+	fi.dec = dec_p;
+	fields_p.push_back (fi);
+	npoint = 1;
     }
 
-    for (Int fld = 0; fld < nfield; fld++) {
-	int sid = sid_p[fld];
+    // Only fields that aren't in the MS yet.
+    Int first = ms_p.field ().nrow ();
+    ms_p.field ().addRow (fields_p.size () - first);
+
+    for (Int fld = first; fld < (Int) fields_p.size (); fld++) {
+	const FieldInfo& fi = fields_p[fld];
+	const SourceInfo& src = sources_p[fi.key.source];
 
-	ms_p.field ().addRow ();
-	msField.sourceId ().put (fld, sid - 1);
-	msField.name ().put (fld, source_p[field[fld]]);
-	msField.code ().put (fld, purpose_p[field[fld]]);
+	msField.sourceId ().put (fld, fi.key.source);
+	msField.name ().put (fld, src.name);
+	msField.code ().put (fld, src.purpose);
 	msField.numPoly ().put(fld, 0);
 
-	cosdec = cos (dec[fld]);
-	radec(0) = ra[fld] + dra[fld] / cosdec;
-	radec(1) = dec[fld] + ddec[fld];
+	cosdec = cos (fi.dec);
+	radec(0) = fi.ra + fi.key.dra / cosdec;
+	radec(1) = fi.dec + fi.key.ddec;
 
 	radecMeas (0).set (MVDirection (radec(0), radec(1)), MDirection::Ref (epochRef_p));
 
@@ -961,27 +3415,17 @@ void
 Converter::fillSourceTable ()
 {
     MSSourceColumns& msSource (msc_p->source ());
-    Int srcidx = -1;
     Vector<Double> radec(2);
 
-    for (uInt i = 0; i < source_p.nelements (); i++) {
-	uInt j;
-
-	for (j = 0; j < i; j++)
-	    if (source_p[i] == source_p[j])
-		break;
-
-	if (j < i)
-	    continue; // duplicate source
-
-	srcidx++;
-	ms_p.source ().addRow ();
+    Int first = ms_p.source ().nrow ();
+    ms_p.source ().addRow (sources_p.size () - first);
 
-	radec(0) = ras_p[i];
-	radec(1) = decs_p[i];
+    for (Int srcidx = first; srcidx < (Int) sources_p.size (); srcidx++) {
+	radec(0) = sources_p[srcidx].ra;
+	radec(1) = sources_p[srcidx].dec;
 
 	msSource.sourceId ().put (srcidx, srcidx);
-	msSource.name ().put (srcidx, source_p[i]);
+	msSource.name ().put (srcidx, sources_p[srcidx].name);
 	// "FIX it due to a bug in MS2 code (6feb2001)":
 	msSource.spectralWindowId ().put (srcidx, 0);
 	msSource.direction ().put (srcidx, radec);
@@ -1035,14 +3479,17 @@ Converter::fillFeedTable ()
     Vector<Double> ra(2);
     ra = 0.0;
 
-    Int row = -1;
+    Int row = ms_p.feed ().nrow () - 1;
 
+    // Arrays already in the MS only need rows for antennas it hadn't seen.
     for (Int arr = 0; arr < (Int) nAnt_p.nelements (); arr++) {
-	for (Int ant = 0; ant < nAnt_p[arr]; ant++) {
+	Int first = (arr < (Int) nantold_p.size ()) ? nantold_p[arr] : 0;
+
+	for (Int ant = first; ant < nAnt_p[arr]; ant++) {
 	    ms_p.feed ().addRow ();
 	    row++;
 
-	    msfc.antennaId ().put (row, ant);
+	    msfc.antennaId ().put (row, arrays_p[arr].antbase + ant);
 	    msfc.beamId ().put (row, -1);
 	    msfc.feedId ().put (row, 0);
 	    msfc.interval ().put (row, DBL_MAX);
@@ -1104,92 +3551,122 @@ Converter::setup_tracking ()
 void
 Converter::track_updates ()
 {
-    // "uv_hasvar" is a misnomer here. It returns true if the variable has been updated.
-
-    if (uv_hasvar ("inttime"))
+    if (inttimevar_p.updated ())
 	inttime_p = uv_getfloat ("inttime");
 
-    if (uv_hasvar ("antpos")) {
+    if (antposvar_p.updated ()) {
 	nants_p = uv_getint ("nants");
 	uv_getdoubles ("antpos", antpos, 3 * nants_p);
     }
 
     if (win.nspect > 0) {
-	if (uv_hasvar ("systemp"))
+	if (systempvar_p.updated ())
 	    uv_getfloats ("systemp", systemp, nants_p * win.nspect);
     } else {
-	if (uv_hasvar ("wsystemp"))
+	if (wsystempvar_p.updated ())
 	    uv_getfloats ("wsystemp", systemp, nants_p);
     }
 
-    int source_updated = uv_hasvar ("source");
+    int source_updated = sourcevar_p.updated ();
 
     if (source_updated) {
 	object_p = uv_getstr ("source");
-
-	// This leads to duplicate values; we strip them out later.
-	source_p.resize (source_p.nelements () + 1, True);
-	source_p[source_p.nelements () - 1] = object_p;
-
-	ras_p.resize (ras_p.nelements () + 1, True);
-	decs_p.resize (decs_p.nelements () + 1, True);
-	ras_p[ras_p.nelements() - 1] = 0.0;
-	decs_p[decs_p.nelements() - 1] = 0.0;
-
-	purpose_p.resize (purpose_p.nelements () + 1, True);
-	purpose_p[purpose_p.nelements () - 1] = "S";
+	sourceIndex (object_p);
     }
 
-    if (source_updated || uv_hasvar ("dra") || uv_hasvar ("ddec")) {
-	int i, j, k;
+    if (source_updated || offsetvar_p.updated ()) {
+	float zero = 0.;
 
 	npoint++;
 	ra_p = uv_getdouble ("ra");
 	dec_p = uv_getdouble ("dec");
-	dra_p = ddec_p = 0.;
+	uvrdvr_c (uv_handle_p, H_REAL, "dra", (char *) &dra_p, (char *) &zero, 1);
+	uvrdvr_c (uv_handle_p, H_REAL, "ddec", (char *) &ddec_p, (char *) &zero, 1);
 	object_p = uv_getstr ("source");
 
-	for (i = 0, j = -1;  i < (int) source_p.nelements (); i++) {
-	    if (source_p[i] == object_p) {
-		j = i;
-		break;
-	    }
-	}
+	FieldKey key;
+	key.source = sourceIndex (object_p);
+	key.dra = dra_p;
+	key.ddec = ddec_p;
 
-	for (i = 0, k = -1; i < nfield; i++) {
-	    if (dra[i] == dra_p && ddec[i] == ddec_p && field[i] == j) {
-		k = i;
-		break;
-	    }
-	}
+	std::unordered_map<FieldKey, Int, FieldKeyHash>::iterator it = fieldindex_p.find (key);
 
-	if (k >= 0) {
+	if (it != fieldindex_p.end ()) {
 	    // This source/field combination is already known.
-	    ifield = k;
+	    ifield = it->second;
 	} else {
-	    ifield = nfield;
-	    nfield++;
-
-	    if (nfield >= MAXFIELD)
-		throw AipsError ("cannot handle more than " + String::toString (MAXFIELD) + " fields");
+	    FieldInfo fi;
+	    fi.key = key;
+	    fi.ra = ra_p;
+	    fi.dec = dec_p;
 
-	    ra[ifield] = ra_p;
-	    dec[ifield] = dec_p;
-	    dra[ifield] = dra_p;
-	    ddec[ifield] = ddec_p;
-	    field[ifield] = j;
-	    sid_p[ifield] = j + 1;
+	    ifield = fields_p.size ();
+	    fields_p.push_back (fi);
+	    fieldindex_p[key] = ifield;
 
 	    if (dra_p == 0.0 && ddec_p == 0.0) {
 		// Store ra/dec for SOURCE table as well.
-		ras_p[j] = ra_p;
-		decs_p[j] = dec_p;
+		sources_p[key.source].ra = ra_p;
+		sources_p[key.source].dec = dec_p;
 	    }
 	}
     }
 }
 
 
+bool
+Converter::skip_record ()
+{
+    /* Advance past one record without reading its data, leaving the
+       time and baseline in the preamble as uvread would. */
+    int iostat;
+
+    uvscan_c (uv_handle_p, "", &iostat);
+    if (iostat)
+	return false;
+
+    refresh_vars ();
+
+    preamble[0] = preamble[1] = preamble[2] = 0.;
+    preamble[3] = timevar_p.value ();
+    preamble[4] = baselinevar_p.value ();
+    return true;
+}
+
+
+// Bring our cached variables up to date after a record has been read.
+
+void
+Converter::refresh_vars ()
+{
+    timevar_p.refresh ();
+    baselinevar_p.refresh ();
+    polvar_p.refresh ();
+    npolvar_p.refresh ();
+}
+
+
+// The index of the named source, adding it if it's new.
+
+Int
+Converter::sourceIndex (const String& name)
+{
+    std::unordered_map<std::string, Int>::iterator it = sourceindex_p.find (name);
+
+    if (it != sourceindex_p.end ())
+	return it->second;
+
+    SourceInfo src;
+    src.name = name;
+    src.purpose = "S";
+    src.ra = src.dec = 0.0;
+
+    sources_p.push_back (src);
+    sourceindex_p[name] = sources_p.size () - 1;
+    return sources_p.size () - 1;
+}
+
+
 void
 Converter::init_window_info ()
 {
@@ -1282,48 +3759,511 @@ Converter::init_window_info ()
 }
 
 
+static void
+convert (String& vis, const String& ms, Int debug, Bool apply_tsys,
+	 const StorageOptions& storage, const FillOptions& fill, const MirIndex *index,
+	 MirStats *stats)
+{
+    Converter conv (vis, debug, apply_tsys, index, stats);
+    FillOptions opts = fill;
+
+    {
+	MirTimer t (mirstats_phase (stats, "checkInput"));
+	conv.checkInput ();
+	conv.setAveraging (fill.chanavg, fill.timeavg);
+    }
+
+    {
+	MirTimer t (mirstats_phase (stats, "setupMeasurementSet"));
+
+	if (fill.resume)
+	    conv.reopenMeasurementSet (ms, opts);
+	else if (fill.append)
+	    conv.appendMeasurementSet (ms, opts);
+	else
+	    conv.setupMeasurementSet (ms, storage);
+    }
+
+    {
+	MirTimer t (mirstats_phase (stats, "subtables"));
+	conv.fillObsTables ();
+	conv.selectArray ();
+    }
+
+    {
+	MirTimer t (mirstats_phase (stats, "fillMSMainTable"));
+	conv.fillMSMainTable (opts);
+    }
+
+    MirTimer t (mirstats_phase (stats, "subtables"));
+    conv.fillSyscalTable ();
+    conv.fillSpectralWindowTable ();
+    conv.fillFieldTable ();
+    conv.fillSourceTable ();
+    conv.fillFeedTable ();
+    conv.fixEpochReferences ();
+    conv.saveState ();
+
+    if (opts.checkpoint > 0)
+	conv.markComplete ();
+}
+
+
+/* Run `work` in a child process, which is how we get around MIRIAD's I/O
+   layer not being thread-safe. Errors are reported from the child, naming
+   it `what`, and turn into its exit status for wait_worker. */
+
+template<class Work>
+static pid_t
+fork_worker (const String& what, Work work)
+{
+    pid_t pid = fork ();
+
+    if (pid < 0)
+	throw AipsError ("failed to fork a worker for " + what);
+
+    if (pid > 0)
+	return pid;
+
+    int status = 0;
+
+    try {
+	work ();
+    } catch (AipsError x) {
+	cerr << "error: " << what << ": " << x.getMesg () << endl;
+	status = 1;
+    } catch (std::exception& x) {
+	cerr << "error: " << what << ": " << x.what () << endl;
+	status = 1;
+    } catch (...) {
+	cerr << "error: " << what << ": unknown exception" << endl;
+	status = 1;
+    }
+
+    // Nothing may unwind past here into our parent's code.
+    _exit (status);
+}
+
+
+// Did the worker succeed?
+
+static Bool
+wait_worker (pid_t pid)
+{
+    int status;
+
+    return (waitpid (pid, &status, 0) >= 0 && WIFEXITED (status) && WEXITSTATUS (status) == 0);
+}
+
+
+static void
+convert_sharded (String& vis, const String& ms, Int debug, Bool apply_tsys,
+		 const StorageOptions& storage, const FillOptions& fill, Int nshards,
+		 const MirIndex& index, const String& statspath, MirStats *stats)
+{
+    /* Split the records into contiguous ranges and convert each one into
+       its own MS in a separate process -- MIRIAD's I/O layer is not
+       thread-safe -- and then glue the pieces together into a
+       multi-MS. Every shard scans the metadata of the whole dataset, so
+       the subtables, field IDs, and scan numbers of all of the pieces
+       agree, and MIRIAD_RECNUM keeps counting from the start of the
+       dataset, so mirmsflagextract can process the result directly.
+       The record index lets us put the boundaries between groups. Each
+       shard writes its own stats report next to ours. */
+
+    MirTimer t (mirstats_phase (stats, "shards"));
+    Int ngroup = index.groups.size ();
+    Block<String> parts (nshards);
+    Block<pid_t> pids (nshards);
+
+    if (ngroup < nshards)
+	throw AipsError ("cannot split " + String::toString (ngroup) +
+			 " polarization groups into " + String::toString (nshards) + " shards");
+
+    for (Int i = 0; i < nshards; i++) {
+	FillOptions shard = fill;
+	shard.recbegin = index.groups[(Int64) ngroup * i / nshards];
+	shard.recend = (i == nshards - 1) ? index.hdr.nrecord :
+	    index.groups[(Int64) ngroup * (i + 1) / nshards];
+	shard.quiet = (i != nshards - 1);
+	parts[i] = ms + ".shard" + String::toString (i);
+
+	pids[i] = fork_worker ("shard " + String::toString (i), [&] () {
+	    MirStats shardobj ("mirtoms");
+	    MirStats *shardstats = stats ? &shardobj : NULL;
+
+	    convert (vis, parts[i], debug, apply_tsys, storage, shard, &index, shardstats);
+
+	    if (shardstats && !shardstats->write ((statspath + ".shard" +
+						   String::toString (i)).chars ()))
+		WARN ("could not write stats report for shard " + String::toString (i));
+	});
+    }
+
+    Int nfailed = 0;
+
+    for (Int i = 0; i < nshards; i++)
+	if (!wait_worker (pids[i]))
+	    nfailed++;
+
+    if (nfailed)
+	throw AipsError (String::toString (nfailed) + " of " +
+			 String::toString (nshards) + " shards failed");
+
+    // The concatenation takes its subtables from the first part; they're
+    // the same in all of them.
+
+    Block<Table> tables (nshards);
+    for (Int i = 0; i < nshards; i++)
+	tables[i] = Table (parts[i], Table::Update);
+
+    // Likewise its column keywords, so the lists of records the shards
+    // omitted from their own ranges have to be merged into the first one.
+
+    if (fill.sparse) {
+	std::vector<Int> omitted;
+
+	for (Int i = 0; i < nshards; i++) {
+	    Vector<Int> part;
+	    ScalarColumn<Int> (tables[i], MIR_REC_COL).keywordSet ().get (MIR_OMIT_KW, part);
+
+	    for (uInt j = 0; j + 1 < part.nelements (); j += 2)
+		add_omitted (omitted, part(j), part(j + 1));
+	}
+
+	ScalarColumn<Int> (tables[0], MIR_REC_COL).rwKeywordSet ().define (MIR_OMIT_KW,
+									   Vector<Int> (omitted));
+    }
+
+    Table concat (tables, Block<String> (), "SUBMSS");
+    concat.rename (ms, Table::New);
+}
+
+
+/* Several input datasets can go into one MS, sharing its subtables:
+   inputs with the same antennas share an array, and those with the same
+   spectral setup share the SPECTRAL_WINDOW and DATA_DESCRIPTION rows.
+   Fields and sources are matched by name and offset as usual. Each input
+   gets an OBSERVATION row, whose ID is also the value of MIRIAD_INPUT, and
+   starts a new scan. That's all done by appending every input after the
+   first, as append=true would, so inputs must agree on their number of
+   channels and windows.
+
+   uvio is not thread-safe, and it never gives back the variable handles a
+   dataset uses, so each input is read in a child process of its own and
+   we never open one here. The record indexes are fetched first, as many
+   at once as we have CPUs, since building one means reading a whole
+   dataset. The conversions themselves still run one at a time, which is
+   a limitation rather than a necessity: an input's subtable rows depend
+   on those of the inputs before it, and there's no way yet for several
+   decoding children to hand their rows to one writer, so for now only
+   the indexing uses more than one CPU. Each child writes its own stats
+   report next to ours.
+
+   With sort=, every input but the last passes its sorted groups on
+   through one shared spill file instead of writing rows, and the last
+   one merges them with its own, so that the whole main table comes out
+   in one order. */
+
+static void
+convert_inputs (std::vector<String>& inputs, const String& ms, Int debug, Bool apply_tsys,
+		const StorageOptions& storage, const FillOptions& fill,
+		const String& statspath, MirStats *stats)
+{
+    Int ninput = inputs.size ();
+
+    if (fill.useindex) {
+	MirTimer t (mirstats_phase (stats, "index"));
+	Int nmax = max ((Int) std::thread::hardware_concurrency (), 1);
+	Block<pid_t> pids (ninput);
+	Int nfailed = 0;
+
+	// No more at once than we have CPUs.
+	for (Int i = 0; i < ninput; i++) {
+	    if (i >= nmax && !wait_worker (pids[i - nmax]))
+		nfailed++;
+
+	    pids[i] = fork_worker ("indexing " + inputs[i], [&] () {
+		MirIndex index;
+		mirindex_get (inputs[i].chars (), index);
+	    });
+	}
+
+	for (Int i = max (ninput - nmax, 0); i < ninput; i++)
+	    if (!wait_worker (pids[i]))
+		nfailed++;
+
+	if (nfailed)
+	    throw AipsError ("could not index " + String::toString (nfailed) + " of " +
+			     String::toString (ninput) + " inputs");
+    }
+
+    MirTimer t (mirstats_phase (stats, "inputs"));
+    int sortfd = fill.sort ? make_spill_file (fill.sorttmp) : -1;
+    std::vector<Int64> sortruns;
+
+    try {
+	for (Int i = 0; i < ninput; i++) {
+	    FillOptions opts = fill;
+	    opts.append = fill.append || i > 0;
+	    opts.sortfd = sortfd;
+	    opts.sortpass = (sortfd >= 0 && i < ninput - 1);
+	    if (sortfd >= 0 && i == ninput - 1)
+		opts.sortruns = sortruns;
+
+	    pid_t pid = fork_worker (inputs[i], [&] () {
+		MirStats inputobj ("mirtoms");
+		MirStats *inputstats = stats ? &inputobj : NULL;
+		MirIndex index;
+
+		// Usually saved by now, so this just loads it.
+		if (opts.useindex)
+		    mirindex_get (inputs[i].chars (), index);
+
+		convert (inputs[i], ms, debug, apply_tsys, storage, opts,
+			 opts.useindex ? &index : 0, inputstats);
+
+		if (inputstats && !inputstats->write ((statspath + ".input" +
+						       String::toString (i)).chars ()))
+		    WARN ("could not write stats report for input " + inputs[i]);
+	    });
+
+	    if (!wait_worker (pid)) {
+		if (i == 0 && !fill.append)
+		    throw AipsError ("could not convert input " + inputs[i]);
+		if (sortfd >= 0)
+		    throw AipsError ("could not convert input " + inputs[i] + "; MS " + ms +
+				     " has the subtables but not the rows of the inputs before it");
+
+		throw AipsError ("could not convert input " + inputs[i] + "; MS " + ms +
+				 " holds the inputs before it");
+	    }
+
+	    // The child appended its groups to the end of the file.
+	    if (opts.sortpass) {
+		struct stat st;
+
+		if (fstat (sortfd, &st) != 0)
+		    throw AipsError ("cannot find the sorted groups of input " + inputs[i]);
+
+		sortruns.push_back (sortruns.empty () ? 0 : sortruns.back ());
+		sortruns.push_back (st.st_size);
+	    }
+	}
+    } catch (...) {
+	if (sortfd >= 0)
+	    close (sortfd);
+	throw;
+    }
+
+    if (sortfd >= 0)
+	close (sortfd);
+}
+
+
 int
 main (int argc, char **argv)
 {
     try {
 	Input inp (1);
 	inp.version ("");
-	inp.create ("vis", "", "path of input MIRIAD dataset", "string");
+	inp.create ("vis", "", "path of input MIRIAD dataset, or comma-separated paths of several", "string");
 	inp.create ("ms", "", "path of output MeasurementSet dataset", "string");
 	inp.create ("tsys", "False", "fill WEIGHT from Tsys in data?", "bool");
 	inp.create ("snumbase", "0", "starting SCAN_NUMBER value", "int");
+	inp.create ("batch", "", "MS rows to buffer per write (default: one integration)", "string");
+	inp.create ("threads", "1", "threads to use: 1, or 2 to decode and write concurrently", "int");
+	inp.create ("shards", "1", "number of processes converting into a multi-MS", "int");
+	inp.create ("tile", "", "DATA/FLAG tile shape as CHANS,ROWS (default: automatic)", "string");
+	inp.create ("tilebytes", "1048576", "target size of a DATA tile in bytes", "int");
+	inp.create ("mmap", "False", "use memory-mapped access to the tiled columns?", "bool");
+	inp.create ("chanavg", "1", "number of channels to average together", "int");
+	inp.create ("timeavg", "0", "seconds of data to average together", "double");
+	inp.create ("index", "True", "use a record index kept in the dataset directory?", "bool");
+	inp.create ("checkpoint", "0", "MIRIAD records between checkpoints (0 = none)", "int");
+	inp.create ("resume", "False", "continue converting into ms= from its last checkpoint?", "bool");
+	inp.create ("append", "False", "add to the existing MS ms= rather than creating it?", "bool");
+	inp.create ("sparse", "False", "omit entirely flagged records from the MS?", "bool");
+	inp.create ("flagcat", "full", "FLAG_CATEGORY contents: full or none", "string");
+	inp.create ("layout", "balanced", "column storage: ism-legacy, balanced, or read-optimized", "string");
+	inp.create ("compress", "none", "DATA storage: none, or lossy (16-bit, per-row scaling)", "string");
+	inp.create ("sort", "none", "row order: none (MIRIAD record order) or time,baseline", "string");
+	inp.create ("sortmem", "1024", "MiB of data to sort in memory before spilling to disk", "int");
+	inp.create ("sorttmp", "", "directory for sort spill files (default: that of ms=)", "string");
+	inp.create ("stats", "", "path of a JSON timing report to write (default: none)", "string");
 	inp.readArguments (argc, argv);
 
 	String vis (inp.getString ("vis"));
 	if (vis == "")
 	    throw AipsError ("no input path (vis=) given");
-	if (! File (vis).isDirectory ())
-	    throw AipsError ("input path (vis=) does not refer to a directory");
+
+	std::vector<String> inputs;
+	for (size_t start = 0, end; start <= vis.length (); start = end + 1) {
+	    end = vis.find (',', start);
+	    if (end == String::npos)
+		end = vis.length ();
+
+	    String path (vis.substr (start, end - start));
+	    if (! File (path).isDirectory ())
+		throw AipsError ("input path (vis=) \"" + path + "\" does not refer to a directory");
+	    inputs.push_back (path);
+	}
 
 	String ms (inp.getString ("ms"));
 	if (ms == "")
-	    ms = vis.before ('.') + ".ms";
+	    ms = inputs[0].before ('.') + ".ms";
 
 	Bool apply_tsys = inp.getBool ("tsys");
-	Int snumbase = inp.getInt ("snumbase");
+	Int nshards = inp.getInt ("shards");
+	if (nshards < 1)
+	    throw AipsError ("shards= must be positive");
+
+	StorageOptions storage;
+	storage.tilechan = storage.tilerows = 0;
+	storage.tilebytes = inp.getInt ("tilebytes");
+	storage.mmap = inp.getBool ("mmap");
+
+	String tile (inp.getString ("tile"));
+	if (tile != "" && (sscanf (tile.chars (), "%d,%d", &storage.tilechan,
+				   &storage.tilerows) != 2 ||
+			   storage.tilechan < 1 || storage.tilerows < 1))
+	    throw AipsError ("tile= must look like CHANS,ROWS");
+
+	String layout (inp.getString ("layout"));
+	if (layout == "ism-legacy")
+	    storage.layout = LAYOUT_ISM_LEGACY;
+	else if (layout == "balanced")
+	    storage.layout = LAYOUT_BALANCED;
+	else if (layout == "read-optimized")
+	    storage.layout = LAYOUT_READ_OPTIMIZED;
+	else
+	    throw AipsError ("layout= must be \"ism-legacy\", \"balanced\", or \"read-optimized\"");
+
+	String compress (inp.getString ("compress"));
+	if (compress == "none")
+	    storage.compress = False;
+	else if (compress == "lossy")
+	    storage.compress = True;
+	else if (compress == "lossless")
+	    throw AipsError ("compress=lossless is not supported by this casacore; use compress=lossy");
+	else
+	    throw AipsError ("compress= must be \"none\" or \"lossy\"");
+
+	FillOptions fill;
+	fill.snumbase = inp.getInt ("snumbase");
+	fill.batchrows = 0;
+	fill.nthreads = inp.getInt ("threads");
+
+	String batch (inp.getString ("batch"));
+	if (batch != "" && (sscanf (batch.chars (), "%d", &fill.batchrows) != 1 ||
+			    fill.batchrows < 1))
+	    throw AipsError ("batch= must be a positive number of rows");
+	if (fill.nthreads != 1 && fill.nthreads != 2)
+	    throw AipsError ("threads= must be 1 or 2");
+	fill.recbegin = 0;
+	fill.recend = -1;
+	fill.quiet = False;
+	fill.sparse = inp.getBool ("sparse");
+	fill.chanavg = inp.getInt ("chanavg");
+	fill.timeavg = inp.getDouble ("timeavg");
+	fill.checkpoint = inp.getInt ("checkpoint");
+	fill.resume = inp.getBool ("resume");
+	fill.append = inp.getBool ("append");
+	fill.startrow = 0;
+	fill.useindex = inp.getBool ("index");
+
+	if ((fill.checkpoint > 0 || fill.resume) && (fill.chanavg > 1 || fill.timeavg > 0))
+	    throw AipsError ("checkpoint= and resume= cannot be combined with averaging");
+	if ((fill.checkpoint > 0 || fill.resume) && nshards > 1)
+	    throw AipsError ("checkpoint= and resume= cannot be combined with shards=");
+
+	String sort (inp.getString ("sort"));
+	if (sort == "none")
+	    fill.sort = False;
+	else if (sort == "time,baseline")
+	    fill.sort = True;
+	else
+	    throw AipsError ("sort= must be \"none\" or \"time,baseline\"");
+
+	if (inp.getInt ("sortmem") < 1)
+	    throw AipsError ("sortmem= must be positive");
+	fill.sortmem = (size_t) inp.getInt ("sortmem") << 20;
+
+	fill.sortfd = -1;
+	fill.sortpass = False;
+	fill.sorttmp = inp.getString ("sorttmp");
+	if (fill.sorttmp == "") {
+	    fill.sorttmp = Path (ms).dirName ();
+	    if (fill.sorttmp == "")
+		fill.sorttmp = ".";
+	}
+
+	// Rows only reach the MS once everything has been sorted, so
+	// there's nothing to checkpoint along the way; shards could only
+	// be sorted separately; and the averager has an order of its own.
+	if (fill.sort && (fill.checkpoint > 0 || fill.resume))
+	    throw AipsError ("sort= cannot be combined with checkpoint= or resume=");
+	if (fill.sort && nshards > 1)
+	    throw AipsError ("sort= cannot be combined with shards=");
+	if (fill.sort && (fill.chanavg > 1 || fill.timeavg > 0))
+	    throw AipsError ("sort= cannot be combined with averaging");
+
+	// Checkpoints and omitted records are kept in terms of the record
+	// numbers of a single dataset.
+	if (inputs.size () > 1 && (fill.checkpoint > 0 || fill.resume))
+	    throw AipsError ("several inputs (vis=) cannot be combined with checkpoint= or resume=");
+	if (inputs.size () > 1 && fill.sparse)
+	    throw AipsError ("several inputs (vis=) cannot be combined with sparse=");
+	if (inputs.size () > 1 && nshards > 1)
+	    throw AipsError ("several inputs (vis=) cannot be combined with shards=");
+
+	// Appending always makes an MS of several inputs.
+	if (fill.append && (fill.checkpoint > 0 || fill.resume))
+	    throw AipsError ("append= cannot be combined with checkpoint= or resume=");
+	if (fill.append && fill.sparse)
+	    throw AipsError ("append= cannot be combined with sparse=");
+	if (fill.append && nshards > 1)
+	    throw AipsError ("append= cannot be combined with shards=");
+
+	String flagcat (inp.getString ("flagcat"));
+	if (flagcat == "full")
+	    fill.flagcat = True;
+	else if (flagcat == "none")
+	    fill.flagcat = False;
+	else
+	    throw AipsError ("flagcat= must be \"full\" or \"none\"");
 
 	// I don't understand what's going on here:
 	int debug = -1;
 	while (inp.debug (debug + 1))
 	    debug++;
 
-	Converter conv (vis, debug, apply_tsys);
-	conv.checkInput ();
-	conv.setupMeasurementSet (ms);
-	conv.fillObsTables ();
-	conv.fillAntennaTable ();
-	conv.fillMSMainTable (snumbase);
-	conv.fillSyscalTable ();
-	conv.fillSpectralWindowTable ();
-	conv.fillFieldTable ();
-	conv.fillSourceTable ();
-	conv.fillFeedTable ();
-	conv.fixEpochReferences ();
+	// Sharding needs the index to split the dataset; without it, we'd
+	// have to scan the dataset to count its records anyway.
+	String statspath (inp.getString ("stats"));
+	MirStats statsobj ("mirtoms");
+	MirStats *stats = (statspath != "") ? &statsobj : NULL;
+
+	if (inputs.size () > 1)
+	    convert_inputs (inputs, ms, debug, apply_tsys, storage, fill, statspath, stats);
+	else {
+	    MirIndex index;
+
+	    if (fill.useindex || nshards > 1) {
+		MirTimer t (mirstats_phase (stats, "index"));
+		mirindex_get (inputs[0].chars (), index);
+	    }
+
+	    if (nshards > 1)
+		convert_sharded (inputs[0], ms, debug, apply_tsys, storage, fill, nshards, index,
+				 statspath, stats);
+	    else
+		convert (inputs[0], ms, debug, apply_tsys, storage, fill,
+			 fill.useindex ? &index : 0, stats);
+	}
+
+	if (stats && !stats->write (statspath.chars ()))
+	    WARN ("could not write stats report to " + statspath);
     } catch (AipsError x) {
 	cerr << "error: " << x.getMesg () << endl;
 	return 1;
@@ -0,0 +1,80 @@
+/* mirvars.h: UV variables resolved once instead of looked up by name
+   Licensed under the GNU GPL version 2 or later.
+
+   uvrdvr_c and uvprobvr_c find their variable by name every time they're
+   called, which adds up when it's done for every record. A MirVarHandle
+   resolves one or more variables into a uvio variable handle once, after
+   which asking whether the last record read updated any of them is
+   uvvarupd_c, a walk over a few pointers. A MirVar also keeps the value of
+   a single scalar variable, and re-reads it only when it changes.
+
+   Call refresh () on every MirVar after every record that is read or
+   scanned, even ones you otherwise ignore, or an update can be missed.
+   uvio has a fixed number of handles and never frees them, so attach
+   each variable once per opened dataset.
+
+   Include this after miriad-c/miriad.h.
+*/
+
+#ifndef MIRVARS_H
+#define MIRVARS_H
+
+class MirVarHandle {
+public:
+    MirVarHandle () : vhan_p (-1) {}
+
+    // Watch `name` too. Variables that the dataset doesn't have are
+    // never updated.
+    void attach (int tno, const char *name)
+    {
+	if (vhan_p < 0)
+	    uvvarini_c (tno, &vhan_p);
+	uvvarset_c (vhan_p, name);
+    }
+
+    // Did the last record read update any of the variables?
+    bool updated () const { return uvvarupd_c (vhan_p); }
+
+private:
+    int vhan_p;
+};
+
+
+template<class T> struct mirvar_type;
+template<> struct mirvar_type<int> { enum { code = H_INT }; };
+template<> struct mirvar_type<float> { enum { code = H_REAL }; };
+template<> struct mirvar_type<double> { enum { code = H_DBLE }; };
+
+
+template<class T>
+class MirVar : public MirVarHandle {
+public:
+    MirVar () : tno_p (-1), name_p (0), value_p (), def_p () {}
+
+    void attach (int tno, const char *name, T def = T ())
+    {
+	MirVarHandle::attach (tno, name);
+	tno_p = tno;
+	name_p = name;
+	value_p = def_p = def;
+    }
+
+    // Returns whether the value changed with the last record read.
+    bool refresh ()
+    {
+	if (!updated ())
+	    return false;
+
+	uvrdvr_c (tno_p, mirvar_type<T>::code, name_p, (char *) &value_p, (char *) &def_p, 1);
+	return true;
+    }
+
+    const T& value () const { return value_p; }
+
+private:
+    int tno_p;
+    const char *name_p;
+    T value_p, def_p;
+};
+
+#endif